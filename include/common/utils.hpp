@@ -47,6 +47,14 @@ namespace arane {
      * Returns the specified type boxed accordingly (e.g. into an array).
      */
     type_info get_boxed (const type_info& ti, ast_ident_type typ);
+    
+    
+    
+    /* 
+     * Hashes the specified string (FNV-1a).  Never returns zero, which marks
+     * hashes that have not been computed yet.
+     */
+    unsigned int str_hash (const char *str, unsigned int len);
   }
 }
 
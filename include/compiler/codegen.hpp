@@ -171,6 +171,7 @@ namespace arane {
     void emit_div ();
     void emit_mod ();
     void emit_concat ();
+    void emit_concat_n (unsigned short count);
     void emit_ref ();
     void emit_deref ();
     void emit_ref_assign ();
@@ -207,6 +208,7 @@ namespace arane {
     void emit_pop_microframe ();
     void emit_load_def ();
     void emit_store_def ();
+    void emit_append (unsigned int index);
     
     void emit_call_builtin (const std::string& name, unsigned char param_count);
     void emit_call (int lbl, unsigned char param_count);
@@ -65,6 +65,23 @@ namespace arane {
       int src_add;    // added to the final source offset.
     };
     
+    /* 
+     * A subroutine's stack map, whose code positions are held in labels
+     * until the end of the compilation phase.
+     */
+    struct c_scope
+    {
+      int start, end;
+      unsigned int first_loc;
+      unsigned int loc_count;
+    };
+    
+    struct c_stack_map
+    {
+      int start, end;
+      std::vector<c_scope> scopes;
+    };
+    
     struct c_deferred
     {
       compilation_context *ctx;
@@ -93,6 +110,7 @@ namespace arane {
     std::queue<c_deferred> dcomps;
     
     std::vector<c_reloc> relocs;
+    std::vector<c_stack_map> smaps;
     module *mod;
     code_generator *cgen;
     std::unordered_map<std::string, unsigned int> data_str_map;
@@ -299,6 +317,7 @@ namespace arane {
     void assign_to_subscript (ast_subscript *lhs, ast_expr *rhs);
     void assign_to_deref (ast_deref *lhs, ast_expr *rhs);
     void assign_in_stack (ast_expr *lhs, bool keep_result);
+    bool compile_append_stmt (ast_binop *ast);
     void enforce_assignment_type (const type_info& lhs_type, ast_expr *rhs);
     
     
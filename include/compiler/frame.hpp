@@ -115,6 +115,12 @@ namespace arane {
      * Allocates an anonymous local variable and returns its index.
      */
     int alloc_local ();
+    
+    /* 
+     * Returns the number of local variables allocated so far in the
+     * enclosing subroutine.
+     */
+    int get_loc_count () const;
   };
 }
 
@@ -20,6 +20,7 @@
 #define _ARANE__INTERPRETER__H_
 
 #include "parser/ast_store.hpp"
+#include "runtime/gc.hpp"
 #include <istream>
 #include <unordered_set>
 
@@ -37,6 +38,20 @@ namespace arane {
   class interpreter
   {
     ast_store asts;
+    gc::gc_options gc_opts;
+    gc::gc_stats gc_stats;
+    
+  public:
+    /* 
+     * Sets the options passed on to the garbage collector of programs
+     * run by the interpreter.
+     */
+    void set_gc_options (const gc::gc_options& opts);
+    
+    /* 
+     * Returns the garbage collector statistics of the last program run.
+     */
+    inline const gc::gc_stats& get_gc_stats () const { return this->gc_stats; }
     
   private:
     module* compile_module (const std::string& name, const std::string& path,
@@ -20,6 +20,8 @@
 #define _ARANE__LINKER__EXECUTABLE__H_
 
 #include "common/byte_buffer.hpp"
+#include "linker/module.hpp"
+#include <vector>
 
 
 namespace arane {
@@ -30,10 +32,12 @@ namespace arane {
   class executable
   {
     byte_buffer code, data;
+    std::vector<stack_map> smaps;
     
   public:
     inline byte_buffer& get_code () { return this->code; }
     inline byte_buffer& get_data () { return this->data; }
+    inline std::vector<stack_map>& get_stack_maps () { return this->smaps; }
   };
 }
 
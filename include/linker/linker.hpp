@@ -22,6 +22,8 @@
 #include "linker/module.hpp"
 #include "linker/executable.hpp"
 #include <vector>
+#include <string>
+#include <unordered_map>
 
 
 namespace arane {
@@ -49,6 +51,10 @@ namespace arane {
     
     executable *exec;
     
+    // positions of string literals in the executable's data section, by
+    // contents.
+    std::unordered_map<std::string, unsigned int> strs;
+    
   private:
     /* 
      * Determins in what order the modules should be loaded in, based
@@ -66,6 +72,11 @@ namespace arane {
      */
     bool handle_imports (module *mod, std::vector<module *>& prev);
     
+    /* 
+     * Moves the specified module's stack maps into the executable.
+     */
+    void handle_stack_maps (module *mod, std::vector<module *>& prev);
+    
   public:
     linker (error_tracker& errs);
     ~linker ();
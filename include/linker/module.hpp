@@ -55,6 +55,29 @@ namespace arane {
   };
   
   
+  /* 
+   * A range of a subroutine's local variables that are only in scope (and
+   * so only live) within a range of its code.
+   */
+  struct local_scope
+  {
+    unsigned int start, end;    // code range of the scope
+    unsigned int first_loc;     // index of the first local variable
+    unsigned int loc_count;
+  };
+  
+  /* 
+   * Tells which local variables of a subroutine are live at every point
+   * of its code, so that the garbage collector can skip dead ones when it
+   * scans the runtime stack.
+   */
+  struct stack_map
+  {
+    unsigned int start, end;    // code range of the subroutine
+    std::vector<local_scope> scopes;
+  };
+  
+  
   enum relocation_type
   {
     REL_CODE,
@@ -88,6 +111,7 @@ namespace arane {
     std::vector<exported_sub> exsubs;
     std::vector<imported_sub> imsubs;
     std::vector<relocation> relocs;
+    std::vector<stack_map> smaps;
     
   public:
     inline const std::string& get_name () const { return this->name; }
@@ -95,6 +119,7 @@ namespace arane {
     inline std::vector<imported_sub>& get_imported_subs () { return this->imsubs; }
     inline std::vector<exported_sub>& get_exported_subs () { return this->exsubs; }
     inline std::vector<relocation>& get_relocations () { return this->relocs; }
+    inline std::vector<stack_map>& get_stack_maps () { return this->smaps; }
     
   public:
     module (const std::string& name);
@@ -130,6 +155,11 @@ namespace arane {
      */
     void add_reloc (relocation reloc);
     
+    /* 
+     * Inserts the specified subroutine stack map into the module.
+     */
+    void add_stack_map (const stack_map& smap);
+    
     /* 
      * Inserts a dependency for the specified module name.
      */
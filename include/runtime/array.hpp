@@ -0,0 +1,85 @@
+/*
+ * Arane - A Perl 6 interpreter.
+ * Copyright (C) 2014 Jacob Zhitomirsky
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ARANE__RUNTIME__ARRAY__H_
+#define _ARANE__RUNTIME__ARRAY__H_
+
+#include "runtime/value.hpp"
+
+
+namespace arane {
+  
+  class garbage_collector;
+  
+  /* 
+   * Storage of array elements.
+   * 
+   * The elements live in a payload allocated through the collector, which
+   * may have unused room both in front of them (left by shift, see
+   * p_value::off) and after them.  Payloads double in size when they run
+   * out of room, and are halved once no more than a quarter of them is in
+   * use, so that pushing and popping around a boundary does not reallocate
+   * every time.  Payloads shared by copies are never modified in place
+   * (see PF_SHARED).
+   */
+  namespace array {
+    
+// room given to arrays that are grown from empty, in elements.
+#define ARRAY_MIN_CAP     4
+    
+    /* 
+     * Allocates an array of "len" elements with room for at least "cap".
+     * The elements are left for the caller to fill in.
+     */
+    p_value* create (garbage_collector& gc, unsigned int len,
+      unsigned int cap = 0);
+    
+    /* 
+     * Makes room for at least "need" elements, counting from the first one.
+     */
+    void reserve (garbage_collector& gc, p_value *arr, unsigned int need);
+    
+    /* 
+     * Stores "val" at the specified index, extending the array with
+     * undefined values if necessary.
+     */
+    void set (garbage_collector& gc, p_value *arr, unsigned int index,
+      const p_value& val);
+    
+    /* 
+     * Appends "val" to the end of the array.
+     */
+    void push (garbage_collector& gc, p_value *arr, const p_value& val);
+    
+    /* 
+     * Removes the last/first element of the specified non-empty array and
+     * returns it.
+     */
+    p_value pop (garbage_collector& gc, p_value *arr);
+    p_value shift (garbage_collector& gc, p_value *arr);
+    
+    /* 
+     * Inserts "count" elements at the start of the array, and returns
+     * a pointer to them for the caller to fill in.
+     */
+    p_value* unshift (garbage_collector& gc, p_value *arr, unsigned int count);
+  }
+}
+
+#endif
+
@@ -43,6 +43,7 @@ namespace arane {
     static void push (virtual_machine& vm, int param_count);
     static void pop (virtual_machine& vm, int param_count);
     static void shift (virtual_machine& vm, int param_count);
+    static void unshift (virtual_machine& vm, int param_count);
     static void range (virtual_machine& vm, int param_count);
   };
 } 
@@ -20,8 +20,15 @@
 #define _ARANE__RUNTIME__GC__H_
 
 #include "runtime/value.hpp"
+#include "runtime/slab.hpp"
+#include "runtime/heap_snapshot.hpp"
+#include "runtime/mark_stack.hpp"
 #include <unordered_set>
-#include <deque>
+#include <unordered_map>
+#include <vector>
+#include <string>
+#include <ostream>
+#include <chrono>
 
 
 namespace arane {
@@ -31,20 +38,32 @@ namespace arane {
   
   namespace gc {
     
-// number of values in a page.
-#define GC_PAGE_SIZE    1024
+    class root_scope;
     
-    constexpr unsigned int
-    free_bitmap_size (unsigned page_size)
-    {
-      return
-        (page_size >> 3) + // a bit for every object
-        (page_size >> 6);  // an auxiliary bitmap
-    }
+// number of values in a page (as many as fit in GC_PAGE_BYTES along with
+// the page's header, rounded down to a multiple of 64).
+#define GC_PAGE_SIZE    1344
+
+// number of 64-bit words in a page's bitmap (one bit per object).
+#define GC_BITMAP_WORDS   (GC_PAGE_SIZE >> 6)
+    
+// bytes reserved for every page, and bytes in the chunks pages are carved
+// out of (both must be powers of two).
+#define GC_PAGE_BYTES     32768
+#define GC_CHUNK_BYTES  1048576
+    
+    static_assert ((GC_PAGE_SIZE & 63) == 0,
+      "GC_PAGE_SIZE must be a multiple of 64");
+    static_assert (GC_BITMAP_WORDS <= 64,
+      "the summary word cannot cover more than 64 bitmap words");
     
     /* 
      * Individual values are grouped into pages or "blocks" which are tracked
      * by the garbage collector.
+     * 
+     * Every page starts at a GC_PAGE_BYTES-aligned address, so the page
+     * that holds an object (and with it the object's mark and free bits)
+     * is found by masking the object's address.
      */
     struct heap_page
     {
@@ -53,9 +72,35 @@ namespace arane {
       // pointer to previous and next page in the chain.
       heap_page *prev, *next;
       
-      unsigned char free_bitmap[free_bitmap_size (GC_PAGE_SIZE)];
+      // a set bit marks a free object.
+      unsigned long long free_bitmap[GC_BITMAP_WORDS];
+      
+      // bit N is set if word N in the free bitmap has any free objects.
+      unsigned long long free_summary;
+      
+      // a set bit marks an object that was reached (or allocated) during the
+      // current GC cycle.
+      unsigned long long mark_bitmap[GC_BITMAP_WORDS];
+      
+      // GC cycle in which the page was put in the page pool.
+      long long idle_since;
+      
+      // set while the page's objects are being moved out of it.
+      bool evacuating;
     };
     
+    static_assert (sizeof (heap_page) <= GC_PAGE_BYTES,
+      "heap_page does not fit in GC_PAGE_BYTES");
+    
+    /* 
+     * Returns the page that contains the specified heap object.
+     */
+    inline heap_page*
+    page_of (const p_value *val)
+    {
+      return (heap_page *)((unsigned long)val & ~((unsigned long)GC_PAGE_BYTES - 1));
+    }
+    
     
     /* 
      * The state of the garbage collector (and not of an object).
@@ -66,6 +111,140 @@ namespace arane {
       GCS_MARK,
       GCS_SWEEP,
     };
+    
+    
+    /* 
+     * Strategies used to decide how much work the collector performs in
+     * every incremental step.
+     */
+    enum pacer_mode
+    {
+      GCP_FIXED,    // constant mark/sweep limits per step.
+      GCP_HEAP,     // finish cycles before the heap outgrows a target overhead.
+      GCP_PAUSE,    // size steps so that they stay within a target pause time.
+    };
+    
+    /* 
+     * Tunable collector parameters.
+     */
+    struct gc_options
+    {
+      unsigned int mark_limit;        // objects marked per step
+      unsigned int sweep_limit;       // pages swept per step
+      unsigned int alloc_threshold;   // allocations between steps
+      long long ext_trigger;          // external bytes that force a full
+                                      // collection (0 to disable)
+      
+      pacer_mode pacer;
+      unsigned int target_overhead;   // percent of the live heap (GCP_HEAP)
+      unsigned int target_pause;      // microseconds (GCP_PAUSE)
+      
+      unsigned int page_pool;         // empty pages kept for reuse
+      unsigned int page_idle_cycles;  // cycles after which pooled pages are
+                                      // returned to the system
+      unsigned int compact;           // percent of used objects below which
+                                      // pages are evacuated (0 to disable)
+      
+      long long arena_limit;          // heap size up to which objects are
+                                      // bump-allocated without collecting
+                                      // (0 to disable, -1 to let the host
+                                      // decide)
+      bool skip_teardown;             // leave the heap to the system when
+                                      // the collector is destroyed
+      
+      std::string snapshot;           // path heap snapshots are written to
+      long long snapshot_at;          // heap size that triggers a snapshot
+                                      // (0 to only write one at exit)
+      
+    public:
+      gc_options ();
+      
+    public:
+      /* 
+       * Sets the option with the specified name (e.g. "mark-limit") from its
+       * textual representation.  Returns false if either the name or the
+       * value are invalid.
+       */
+      bool set (const std::string& name, const std::string& value);
+      
+      /* 
+       * Reads options from ARANE_GC_* environment variables
+       * (e.g. ARANE_GC_MARK_LIMIT).
+       */
+      void load_env ();
+    };
+    
+    
+// arena limit used for short-lived programs (e.g. -e one-liners) when no
+// limit is set explicitly.
+#define GC_AUTO_ARENA_LIMIT  33554432    // 32MB
+    
+// number of buckets in the pause histogram.  bucket 0 holds pauses shorter
+// than a microsecond, bucket N holds pauses of [2^(N-1), 2^N) microseconds
+// and the last bucket holds everything longer.
+#define GC_PAUSE_BUCKETS    20
+    
+    /* 
+     * Collector telemetry.  All times are in nanoseconds.
+     */
+    struct gc_stats
+    {
+      long long cycles;               // completed cycles
+      long long full_collections;
+      long long steps;                // incremental steps (pauses)
+      
+      long long mark_time;            // total time spent marking
+      long long sweep_time;           // total time spent sweeping
+      long long last_mark_time;       // mark time of the last cycle
+      long long last_sweep_time;      // sweep time of the last cycle
+      long long max_pause;
+      long long total_pause;
+      long long pause_hist[GC_PAUSE_BUCKETS];
+      
+      long long objs_allocated;
+      long long objs_freed;
+      long long bytes_freed;          // objects and their payloads
+      long long last_objs_freed;      // objects freed by the last cycle
+      long long last_bytes_freed;     // bytes freed by the last cycle
+      long long live_objs;            // objects marked in the last cycle
+      long long objs;                 // objects currently allocated
+      
+      long long pages;                // pages currently allocated
+      long long peak_pages;
+      long long total_pages;          // pages allocated since startup
+      long long pooled_pages;         // empty pages kept for reuse
+      long long released_pages;       // empty pages returned to the system
+      long long mapped_bytes;         // memory reserved for pages
+      long long payload_slabs;
+      long long large_objects;        // payloads in the large object space
+      long long large_bytes;
+      
+      long long compactions;
+      long long objs_moved;           // objects moved by compaction
+      long long pages_compacted;      // pages emptied by compaction
+      
+      long long ext_bytes;            // bytes held in external payloads
+      long long peak_ext_bytes;
+      long long total_ext_bytes;      // external bytes allocated since startup
+      
+      long long run_time;             // time since the collector was created
+      bool in_arena;                  // still allocating from the arena
+      
+    public:
+      gc_stats ();
+      
+    public:
+      /* 
+       * Returns the amount of bytes (objects and payloads) allocated per
+       * second.
+       */
+      double alloc_rate () const;
+      
+      /* 
+       * Prints a human-readable report to the specified stream.
+       */
+      void print (std::ostream& strm) const;
+    };
   }
   
   
@@ -74,11 +253,16 @@ namespace arane {
    */
   class garbage_collector
   {
+    friend class gc::root_scope;
+    
     virtual_machine& vm;
+    gc::gc_options opts;
+    gc::gc_stats stats;
+    std::chrono::steady_clock::time_point start_time;
     
     gc::gc_state state;
     unsigned int alloc_count;
-    unsigned int total_alloc_count;
+    long long total_alloc_count;
     
     long long total_ext_bytes;
     long long ext_bytes;
@@ -86,14 +270,49 @@ namespace arane {
     long long last_alloc_count;
     long long inc_count;
     
-    // the current "meaning" of white objects.
-    unsigned char curr_white;
-    
     gc::heap_page *pages;
     gc::heap_page *to_sweep;
-    std::deque<p_value *> grays;
+    std::vector<p_value *> temp_roots;          // see gc::root_scope
+    std::vector<bool> dead_slots;               // stack slots of dead locals
+    std::vector<__mpz_struct> bint_pool;        // cleared integers whose
+                                                // limbs can be reused
+    std::vector<void *> chunks;                 // memory pages are carved from
+    std::vector<gc::heap_page *> pool;          // empty pages, oldest first
+    std::vector<gc::heap_page *> released;      // decommitted empty pages
+    gc::mark_stack grays;
+    gc::slab_allocator payloads;
+    std::unordered_map<void *, unsigned int> shared;  // objects sharing each
+                                                      // copy-on-write payload
     unsigned int page_count;
     unsigned int total_page_count;
+    long long obj_count;
+    
+    // pacing:
+    unsigned int mark_budget;
+    unsigned int sweep_budget;
+    unsigned int swept_pages;
+    long long live_objs;        // objects marked in the last cycle
+    long long live_bytes;       // heap size after the last cycle
+    long long last_heap_size;   // heap size at the last step
+    double pause_scale;
+    
+    // compaction:
+    unsigned int sparse_pages;  // pages found sparse by the current cycle
+    bool compact_pending;
+    
+    // telemetry for the cycle in progress:
+    long long cycle_mark_time;
+    long long cycle_sweep_time;
+    long long cycle_objs_freed;
+    long long cycle_bytes_freed;
+    long long last_work_time;
+    
+    // set once a heap snapshot has been written.
+    bool snapshot_taken;
+    
+    // arena mode:
+    bool in_arena;
+    unsigned int bump;          // next free object in the head page
     
     // debug:
     unsigned int counter;
@@ -105,10 +324,26 @@ namespace arane {
      * Constructs a garbage collector on top of the specified runtime stack.
      * The given stack will function as the collector's "root" set.
      */
-    garbage_collector (virtual_machine& vm);
+    garbage_collector (virtual_machine& vm,
+      const gc::gc_options& opts = gc::gc_options ());
     
     ~garbage_collector ();
     
+  private:
+    /* 
+     * Routes GMP's memory allocation through the collector's payload
+     * allocator, so that growing integers count as external bytes.
+     * Integers initialized before this must not be resized or cleared
+     * until unhook_gmp () is called.
+     */
+    void hook_gmp ();
+    
+    /* 
+     * Restores GMP's previous memory functions.  Integers allocated while
+     * hooked must not be resized or cleared afterwards.
+     */
+    void unhook_gmp ();
+    
   private:
     /* 
      * Allocates a new empty heap page.
@@ -116,10 +351,26 @@ namespace arane {
     gc::heap_page* alloc_page ();
     
     /* 
-     * Destroys the page and all the objects inside it.
+     * Destroys all the objects inside the specified page.
      */
     void free_page (gc::heap_page *page);
     
+    /* 
+     * Maps a new chunk of memory and adds its pages to the released list.
+     */
+    void alloc_chunk ();
+    
+    /* 
+     * Puts the specified empty page in the page pool.
+     */
+    void pool_page (gc::heap_page *page);
+    
+    /* 
+     * Returns pooled pages that have been idle for too long, or that do not
+     * fit in the pool, to the system.
+     */
+    void trim_pool ();
+    
     /* 
      * Links the specified heap page to the rest.
      */
@@ -136,7 +387,29 @@ namespace arane {
      */
     void delete_object (p_value& val);
     
+    /* 
+     * Puts the specified integer in the bigint pool, or clears it if the
+     * pool is full.
+     */
+    void recycle_bint (mpz_t n);
+    
   private:
+    /* 
+     * Bump-allocates an object from the head page (arena mode).
+     */
+    p_value* arena_alloc ();
+    
+    /* 
+     * Switches from arena mode to regular garbage-collected allocation.
+     */
+    void leave_arena ();
+    
+  private:
+    /* 
+     * Clears the mark bitmaps of all pages.
+     */
+    void clear_marks ();
+    
     /* 
      * Prepares the root set by marking the root objects (stack, globals, etc...)
      */
@@ -149,15 +422,22 @@ namespace arane {
     bool incremental_mark (unsigned int limit);
     
     /* 
-     * Marks the children of the specified value.
+     * Marks the children of the specified gray object.
+     * Returns the amount of work done, in units of marked objects.
      */
-    void mark_children (p_value *val);
+    unsigned int mark_children (gc::mark_entry ent);
     
     /* 
      * Inserts the specified object into the gray set.
      */
     void paint_gray (p_value *val);
     
+    /* 
+     * Checks whether the specified reference points to a heap object
+     * (rather than to a slot in the VM's stack).
+     */
+    bool is_heap_ref (p_value *ref);
+    
     
     
     /* 
@@ -171,6 +451,90 @@ namespace arane {
      */
     bool incremental_sweep (unsigned int limit);
     
+    
+    
+    /* 
+     * Marks the specified object as pinned if it lives in a page that is
+     * being evacuated.
+     */
+    void pin (p_value *ref);
+    
+    /* 
+     * Moves the object referenced by the specified value to its new location
+     * if it has been evacuated.
+     */
+    void forward (p_value& val);
+    
+  private:
+    /* 
+     * Returns the approximate size of the heap in bytes (objects and
+     * external payloads).
+     */
+    long long heap_size () const;
+    
+    /* 
+     * Returns the heap size the pacer tries to keep the heap under
+     * (used by the GCP_HEAP pacer).
+     */
+    long long heap_goal () const;
+    
+    /* 
+     * Checks whether a new collection cycle should be started.
+     */
+    bool should_start_cycle () const;
+    
+    /* 
+     * Computes the amount of work to do in the next step.
+     */
+    void pace ();
+    
+    /* 
+     * Adjusts the step size according to how long the last step took
+     * (used by the GCP_PAUSE pacer).
+     */
+    void adjust_pause (long long usecs);
+    
+    /* 
+     * Performs one incremental step and records its duration.
+     */
+    void step ();
+    
+    /* 
+     * Adds a pause of the specified length (in nanoseconds) to the stats.
+     */
+    void record_pause (long long nsecs);
+    
+  public:
+    /* 
+     * Returns a snapshot of the collector's statistics.
+     */
+    gc::gc_stats get_stats () const;
+    
+    /* 
+     * Performs a full collection and records the resulting object graph
+     * in the specified heap snapshot.
+     */
+    void take_snapshot (gc::heap_snapshot& snap);
+    
+    /* 
+     * Writes a heap snapshot to the file at the specified path.
+     * Returns false if the file could not be written.
+     */
+    bool write_snapshot (const std::string& path);
+    
+    /* 
+     * Asks the collector to write a heap snapshot to the configured path
+     * at its next step.  Safe to call from a signal handler.
+     */
+    static void request_snapshot ();
+    
+    /* 
+     * Writes a heap snapshot to the configured path if one was requested
+     * or if the heap has grown past the snapshot threshold.  If "at_exit"
+     * is true, a snapshot is written unless one had been written before.
+     */
+    void check_snapshot (bool at_exit = false);
+    
   public:
     /* 
      * Notifies the collector that the specified amount of bytes have been
@@ -184,6 +548,85 @@ namespace arane {
      */
     void notify_decrease (unsigned int count);
     
+  public:
+    /* 
+     * Allocates an external payload (array elements, string data, etc...)
+     * of at least the specified amount of bytes.  The size is updated to
+     * hold the actual capacity of the payload.
+     */
+    void* alloc_payload (unsigned int& size);
+    
+    /* 
+     * Resizes the specified payload, preserving its first "used" bytes.
+     * The new size is updated to hold the actual capacity of the payload.
+     */
+    void* resize_payload (void *ptr, unsigned int used, unsigned int old_size,
+      unsigned int& new_size);
+    
+    /* 
+     * Releases a payload of the specified capacity.
+     */
+    void free_payload (void *ptr, unsigned int size);
+    
+    /* 
+     * Same as above, but with capacities measured in elements/characters.
+     */
+    p_value* alloc_array_data (unsigned int& cap);
+    p_value* resize_array_data (p_value *data, unsigned int len,
+      unsigned int old_cap, unsigned int& cap);
+    char* alloc_string_data (unsigned int& cap);
+    char* resize_string_data (char *data, unsigned int len,
+      unsigned int old_cap, unsigned int& cap);
+    
+    /* 
+     * Makes the specified copy of an array or string share the payload of
+     * the original, until either is modified (see PF_SHARED).
+     */
+    void share_payload (p_value *orig, p_value *copy);
+    
+    /* 
+     * Gives the specified array or string a payload of its own if it shares
+     * one.  Must be called before the payload is modified.
+     */
+    inline void
+    unshare (p_value *obj)
+    {
+      if (obj->flags & PF_SHARED)
+        this->copy_shared (obj);
+    }
+    
+  private:
+    /* 
+     * Removes an object from the sharers of the specified payload.  Returns
+     * true if no other object uses the payload anymore.
+     */
+    bool release_shared (void *payload);
+    
+    void copy_shared (p_value *obj);
+    
+  public:
+    /* 
+     * Has the specified array scanned again if it is being marked, after its
+     * elements have moved towards the end of its payload.
+     */
+    void rescan (p_value *obj);
+    
+    /* 
+     * Has the object referenced by the specified value marked if a cycle is
+     * marking.  Called before the value is removed from or overwritten in a
+     * heap object, since it may have been moved somewhere already scanned
+     * (or onto the stack, which is only scanned when the cycle starts).
+     */
+    void shade (const p_value& val);
+    
+    
+    /* 
+     * Initializes the specified integer to zero, reusing the limbs of a
+     * previously destroyed integer if possible.  Bigint results should be
+     * initialized through this rather than with mpz_init().
+     */
+    void init_bint (mpz_t n);
+    
   public:
     /* 
      * Performs a full garbage collection.
@@ -195,13 +638,71 @@ namespace arane {
      */
     void work ();
     
+    /* 
+     * Checks whether the last cycle left behind enough sparse pages for
+     * compaction to be worthwhile.
+     */
+    inline bool compaction_pending () const { return this->compact_pending; }
+    
+    /* 
+     * Evacuates sparse pages.  Objects referenced from the VM stack or from
+     * a root_scope are pinned and stay in place; all other references to
+     * moved objects are updated, so this must only be called when no native
+     * code holds on to heap objects (i.e. in between two instructions).
+     */
+    void compact ();
+    
     
     /* 
      * Allocates and returns a new object.
+     * 
+     * Collection work only ever happens inside alloc(), so a fresh object is
+     * safe until the next allocation.  It must be made reachable (stored in
+     * the VM stack, in another object, or in a gc::root_scope) before
+     * anything else is allocated.
      */
-    p_value* alloc (bool protect);
-    p_value* alloc_copy (p_value& other, bool protect);
+    p_value* alloc ();
+    p_value* alloc_copy (p_value& other);
   };
+  
+  
+  
+  namespace gc {
+    
+    /* 
+     * Keeps objects alive for as long as the scope exists, by pushing them
+     * onto the collector's shadow stack of temporary roots.  Meant for
+     * builtins and value helpers that hold on to an object across further
+     * allocations before it becomes reachable from the VM stack.
+     */
+    class root_scope
+    {
+      garbage_collector& gc;
+      size_t base;
+      
+    public:
+      root_scope (garbage_collector& gc)
+        : gc (gc), base (gc.temp_roots.size ())
+        { }
+      
+      ~root_scope ()
+        { this->gc.temp_roots.resize (this->base); }
+      
+      root_scope (const root_scope&) = delete;
+      root_scope& operator= (const root_scope&) = delete;
+      
+    public:
+      /* 
+       * Roots the specified object and returns it.
+       */
+      inline p_value*
+      add (p_value *obj)
+      {
+        this->gc.temp_roots.push_back (obj);
+        return obj;
+      }
+    };
+  }
 }
 
 #endif
@@ -0,0 +1,144 @@
+/*
+ * Arane - A Perl 6 interpreter.
+ * Copyright (C) 2014 Jacob Zhitomirsky
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ARANE__RUNTIME__HEAP_SNAPSHOT__H_
+#define _ARANE__RUNTIME__HEAP_SNAPSHOT__H_
+
+#include <vector>
+#include <string>
+#include <istream>
+#include <ostream>
+
+
+namespace arane {
+  
+  namespace gc {
+    
+    /* 
+     * An object recorded in a heap snapshot.  Objects are identified by
+     * their index in the snapshot.
+     */
+    struct snapshot_object
+    {
+      unsigned char type;           // p_value_type
+      unsigned int self_size;       // size of the object itself
+      unsigned int payload_size;    // bytes held outside of the object
+      unsigned int len;             // array/string length
+      
+      // range of the object's outgoing references in the reference list.
+      unsigned int first_ref;
+      unsigned int ref_count;
+    };
+    
+    /* 
+     * A reference to a heap object held by the VM (stack slot or global).
+     */
+    struct snapshot_root
+    {
+      std::string name;
+      unsigned int obj;
+    };
+    
+    
+    /* 
+     * A copy of the object graph of a heap, along with its roots.
+     * 
+     * Snapshots are stored in a compact line-based text format:
+     * 
+     *     arane-heap <version> <object count> <root count>
+     *     <type> <self size> <payload size> <length> <ref count> <refs...>
+     *     ...
+     *     <object> <root name>
+     *     ...
+     * 
+     * where the N'th object line describes object N.
+     */
+    class heap_snapshot
+    {
+      std::vector<snapshot_object> objs;
+      std::vector<unsigned int> refs;
+      std::vector<snapshot_root> roots;
+      
+      // results of analyze():
+      std::vector<unsigned int> idom;       // immediate dominators
+      std::vector<long long> retained;      // retained sizes
+      bool analyzed;
+      
+    public:
+      inline unsigned int get_object_count () const { return this->objs.size (); }
+      inline const std::vector<snapshot_object>& get_objects () const { return this->objs; }
+      inline const std::vector<snapshot_root>& get_roots () const { return this->roots; }
+      
+    public:
+      heap_snapshot ();
+      
+    public:
+      /* 
+       * Appends a new object to the snapshot and returns its index.
+       * References added afterwards are attributed to this object.
+       */
+      unsigned int add_object (unsigned char type, unsigned int self_size,
+        unsigned int payload_size, unsigned int len);
+      
+      /* 
+       * Adds a reference from the last added object to the specified one.
+       */
+      void add_ref (unsigned int obj);
+      
+      /* 
+       * Adds a root reference to the specified object.
+       */
+      void add_root (const std::string& name, unsigned int obj);
+      
+    public:
+      /* 
+       * Writes the snapshot to the specified stream.
+       */
+      void save (std::ostream& strm) const;
+      
+      /* 
+       * Reads a snapshot from the specified stream.
+       * Returns false if the stream does not hold a valid snapshot.
+       */
+      bool load (std::istream& strm);
+      
+    public:
+      /* 
+       * Computes the dominator tree of the object graph and the retained
+       * size of every object (the amount of memory that would be freed if
+       * the object became unreachable).
+       */
+      void analyze ();
+      
+      /* 
+       * Returns the retained size of the specified object, or -1 if the
+       * object is not reachable from any root.
+       */
+      long long get_retained_size (unsigned int obj) const;
+      
+      /* 
+       * Prints an object census by type along with the roots and objects
+       * that retain the most memory.
+       */
+      void print_report (std::ostream& strm, unsigned int top = 10);
+    };
+  }
+}
+
+#endif
+
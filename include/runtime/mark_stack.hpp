@@ -0,0 +1,124 @@
+/*
+ * Arane - A Perl 6 interpreter.
+ * Copyright (C) 2014 Jacob Zhitomirsky
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ARANE__RUNTIME__MARK_STACK__H_
+#define _ARANE__RUNTIME__MARK_STACK__H_
+
+
+namespace arane {
+  
+  struct p_value;
+  
+  namespace gc {
+    
+// number of entries in a single mark stack chunk.
+#define MARK_CHUNK_SIZE   511
+
+// cursor value of objects whose children have not been scanned at all.
+#define MARK_UNSCANNED    0xFFFFFFFFU
+    
+    /* 
+     * A gray object along with the position its scan should resume from
+     * (used to scan large arrays in bounded chunks).
+     */
+    struct mark_entry
+    {
+      p_value *obj;
+      unsigned int cursor;
+    };
+    
+    struct mark_chunk
+    {
+      mark_chunk *prev;
+      unsigned int count;
+      mark_entry entries[MARK_CHUNK_SIZE];
+    };
+    
+    
+    /* 
+     * The stack of gray objects used by the marking phase.
+     * 
+     * Entries are stored in fixed-size chunks linked together, so growing
+     * the stack never moves existing entries, and a single spare chunk is
+     * kept around to avoid hitting the allocator when the stack keeps
+     * crossing a chunk boundary.
+     */
+    class mark_stack
+    {
+      mark_chunk *top;
+      mark_chunk *spare;
+      unsigned int chunk_count;
+      
+    public:
+      inline bool
+      empty () const
+        { return this->top->count == 0 && !this->top->prev; }
+      
+      inline unsigned long
+      size () const
+      {
+        return (unsigned long)(this->chunk_count - 1) * MARK_CHUNK_SIZE
+          + this->top->count;
+      }
+      
+    public:
+      mark_stack ();
+      ~mark_stack ();
+      
+    private:
+      void grow ();
+      void shrink ();
+      
+    public:
+      inline void
+      push (p_value *val, unsigned int cursor = MARK_UNSCANNED)
+      {
+        if (this->top->count == MARK_CHUNK_SIZE)
+          this->grow ();
+        this->top->entries[this->top->count++] = { val, cursor };
+      }
+      
+      inline void
+      push (const mark_entry& ent)
+      {
+        if (this->top->count == MARK_CHUNK_SIZE)
+          this->grow ();
+        this->top->entries[this->top->count++] = ent;
+      }
+      
+      /* 
+       * Removes and returns the top entry.  The stack must not be empty.
+       */
+      inline mark_entry
+      pop ()
+      {
+        if (this->top->count == 0)
+          this->shrink ();
+        return this->top->entries[-- this->top->count];
+      }
+      
+      /* 
+       * Removes all entries and releases all chunks but one.
+       */
+      void clear ();
+    };
+  }
+}
+
+#endif
+
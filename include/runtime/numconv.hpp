@@ -0,0 +1,67 @@
+/*
+ * Arane - A Perl 6 interpreter.
+ * Copyright (C) 2014 Jacob Zhitomirsky
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ARANE__RUNTIME__NUMCONV__H_
+#define _ARANE__RUNTIME__NUMCONV__H_
+
+#include <gmp.h>
+
+
+namespace arane {
+  
+  /* 
+   * Conversions between integers and their decimal representation.
+   */
+  namespace numconv {
+    
+// number of characters needed to hold any 64-bit integer, including the sign.
+#define INT_STR_SIZE      20
+    
+    enum parse_status
+    {
+      PARSE_OK,
+      PARSE_NONE,       // no digits
+      PARSE_OVERFLOW,   // does not fit in 64 bits
+    };
+    
+    
+    /* 
+     * Parses the decimal integer at the start of the specified string, the
+     * same way `>>' on a stream would: leading whitespace and a sign are
+     * skipped, and parsing stops at the first non-digit.  If the value does
+     * not fit, it is clamped and PARSE_OVERFLOW is returned, in which case
+     * parse_bint () should be used to read it.
+     */
+    parse_status parse_int (const char *str, unsigned int len, long long& res);
+    
+    /* 
+     * Same as parse_int (), but into a big integer.
+     */
+    void parse_bint (const char *str, unsigned int len, mpz_ptr res);
+    
+    /* 
+     * Writes the decimal representation of the specified integer into
+     * "buf", which must have room for at least INT_STR_SIZE characters.
+     * Returns the number of characters written (no null is appended).
+     */
+    unsigned int format_int (long long n, char *buf);
+  }
+}
+
+#endif
+
@@ -0,0 +1,97 @@
+/*
+ * Arane - A Perl 6 interpreter.
+ * Copyright (C) 2014 Jacob Zhitomirsky
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ARANE__RUNTIME__OUTPUT__H_
+#define _ARANE__RUNTIME__OUTPUT__H_
+
+#include <ostream>
+#include <gmp.h>
+
+
+namespace arane {
+  
+// size of the user-space buffer output is collected in before it is handed
+// to the underlying stream.
+#define OUTPUT_BUFFER_SIZE    65536
+  
+  /* 
+   * Buffers the output of a running program.
+   * 
+   * Values are formatted directly into a single large buffer, which is only
+   * passed on to the underlying stream when it fills up, when the writer is
+   * flushed (at the end of the program), or at the end of every line if the
+   * stream is standard output connected to a terminal.
+   */
+  class output_writer
+  {
+    std::ostream *strm;
+    char *buf;
+    unsigned int pos;
+    bool line_buffered;
+    
+  public:
+    output_writer (std::ostream *strm);
+    ~output_writer ();
+    
+    output_writer (const output_writer&) = delete;
+    output_writer& operator= (const output_writer&) = delete;
+    
+  public:
+    /* 
+     * Flushes pending output, and redirects everything written from now on
+     * to the specified stream.
+     */
+    void set_stream (std::ostream *strm);
+    
+    inline void
+    put (char c)
+    {
+      if (this->pos == OUTPUT_BUFFER_SIZE)
+        this->flush ();
+      this->buf[this->pos++] = c;
+    }
+    
+    void write (const char *data, unsigned int len);
+    void write_int (long long n);
+    void write_bint (mpz_srcptr n);
+    
+    /* 
+     * Terminates the current line.
+     */
+    void end_line ();
+    
+    /* 
+     * Flushes the output if it is line buffered.  Called at the end of
+     * every print, so that partial lines show up on a terminal as well.
+     */
+    inline void
+    sync ()
+    {
+      if (this->line_buffered)
+        this->flush ();
+    }
+    
+    /* 
+     * Hands all buffered output over to the underlying stream, and flushes it.
+     */
+    void flush ();
+  };
+}
+
+#endif
+
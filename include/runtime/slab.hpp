@@ -0,0 +1,136 @@
+/*
+ * Arane - A Perl 6 interpreter.
+ * Copyright (C) 2014 Jacob Zhitomirsky
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ARANE__RUNTIME__SLAB__H_
+#define _ARANE__RUNTIME__SLAB__H_
+
+#include <vector>
+
+
+namespace arane {
+  
+  namespace gc {
+    
+// size of a single slab in bytes (must be a power of two).
+#define SLAB_SIZE           65536
+
+// smallest and largest size classes served from slabs.
+#define SLAB_MIN_CLASS         16
+#define SLAB_MAX_CLASS       4096
+#define SLAB_CLASS_COUNT        9
+
+// payloads larger than this are mapped directly from the system and are
+// tracked separately (the large object space).
+#define LARGE_PAYLOAD_SIZE  262144
+    
+    /* 
+     * A fixed-size chunk of memory carved into equally sized blocks of a
+     * single size class.  The header lives at the start of the chunk, and
+     * since slabs are aligned to their size, the slab that owns a block can
+     * be found by masking the block's address.
+     */
+    struct slab
+    {
+      // pointer to previous and next slab in the size class' partial list.
+      slab *prev, *next;
+      
+      void *free_list;
+      unsigned int bump;      // offset of the first never-used block
+      unsigned int used;      // number of blocks handed out
+      unsigned char cls;      // size class index
+      bool partial;           // whether the slab is in the partial list
+    };
+    
+    
+    /* 
+     * Allocates the external payloads of heap objects (array elements and
+     * string data).  Small payloads are served from per-size-class slabs,
+     * where growing a payload within its size class is free, and larger
+     * payloads are passed on to malloc/realloc.  Payloads larger than
+     * LARGE_PAYLOAD_SIZE live in the large object space: each one gets
+     * its own mapping, which is grown without copying where the system
+     * allows it and is returned to the system as soon as it is freed.
+     * 
+     * All sizes passed to and returned by the allocator are in bytes. Since
+     * the size of a block is deduced from the size given when it is freed,
+     * a payload must be freed with the capacity that was returned when it
+     * was allocated (or any size that rounds up to the same size class).
+     */
+    class slab_allocator
+    {
+      slab *partial[SLAB_CLASS_COUNT];
+      std::vector<slab *> slabs;
+      
+      unsigned int large_count;
+      long long large_bytes;
+    
+    public:
+      inline unsigned int get_slab_count () const { return this->slabs.size (); }
+      inline unsigned int get_large_count () const { return this->large_count; }
+      inline long long get_large_bytes () const { return this->large_bytes; }
+    
+    public:
+      slab_allocator ();
+      ~slab_allocator ();
+    
+    private:
+      void* alloc_large (unsigned int& size);
+      void* resize_large (void *ptr, unsigned int used, unsigned int old_size,
+        unsigned int& new_size);
+      void free_large (void *ptr, unsigned int size);
+      
+      slab* alloc_slab (unsigned int cls);
+      void link_partial (slab *s);
+      void unlink_partial (slab *s);
+    
+    public:
+      /* 
+       * Returns the amount of bytes actually reserved for a payload of the
+       * specified size.
+       */
+      static unsigned int round_size (unsigned int size);
+      
+      /* 
+       * Allocates a payload of at least the specified amount of bytes.
+       * The size is updated to hold the actual capacity of the payload.
+       */
+      void* alloc (unsigned int& size);
+      
+      /* 
+       * Releases a payload of the specified capacity.
+       */
+      void free (void *ptr, unsigned int size);
+      
+      /* 
+       * Resizes the specified payload, preserving its first "used" bytes.
+       * Growth within the payload's size class happens in place.
+       * The new size is updated to hold the actual capacity of the payload.
+       */
+      void* resize (void *ptr, unsigned int used, unsigned int old_size,
+        unsigned int& new_size);
+      
+      /* 
+       * Returns completely unused slabs back to the system.
+       */
+      void release_empty ();
+    };
+  }
+}
+
+#endif
+
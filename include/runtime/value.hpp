@@ -28,6 +28,7 @@ namespace arane {
   
   class big_int;
   class virtual_machine;
+  class output_writer;
   
   
   /* 
@@ -43,6 +44,7 @@ namespace arane {
     PERL_ARRAY,
     PERL_BIGINT,
     PERL_BOOL,
+    PERL_ISTR,    // short string stored in place (see ISTR_MAX_LEN)
     
     PERL_TYPE,
     
@@ -52,6 +54,43 @@ namespace arane {
   
   p_value_type p_get_ref_type (p_value_type type);
   
+  /* 
+   * Flags of values allocated by the garbage collector.
+   */
+  enum p_value_flags: unsigned char
+  {
+    // the string is referenced from a single local variable only, and can
+    // be appended to in place.  Cleared once the string gets a second holder
+    // (see p_value_share ()).
+    PF_UNIQUE = 1 << 0,
+    
+    // the string is a rope: its data points to a p_rope instead of to its
+    // characters (see p_value_flatten ()).
+    PF_ROPE   = 1 << 1,
+    
+    // the array or string shares its payload with copies of it, and must
+    // get one of its own before modifying it (copy-on-write, see
+    // garbage_collector::unshare ()).
+    PF_SHARED = 1 << 2,
+    
+    // the string holds the last characters of one or more ropes, each of
+    // which uses a prefix of it.  It is only reachable through those ropes,
+    // and characters are appended to it in place (see p_rope).
+    PF_TAIL   = 1 << 3,
+  };
+  
+// concatenating strings at least this long links them into a rope instead of
+// copying them.
+#define ROPE_MIN_LEN      256
+
+// ropes nested deeper than this are flattened, which bounds the number of
+// nodes per character of ropes that are not built by appending.
+#define ROPE_MAX_DEPTH    64
+
+// strings up to this long are stored inside the value itself (PERL_ISTR),
+// and need no allocation.
+#define ISTR_MAX_LEN      15
+  
   
   
   /* 
@@ -83,20 +122,61 @@ namespace arane {
             unsigned int cap;
           } arr;
         p_value *ref;
+        
+        // the characters of a PERL_ISTR string, null-terminated and padded
+        // with zeroes, so that equal strings are equal bytewise.  The last
+        // byte holds the number of unused bytes (see p_istr_len ()).
+        char istr[ISTR_MAX_LEN + 1];
       } val;
     
-    // fields used by the GC:
-    bool is_gc;               // to differentiate from plain references
-    unsigned char gc_state;
-    unsigned char gc_protect;
     
     p_value_type type;
+    
+    // PF_* bits, only meaningful for values allocated by the collector.
+    unsigned char flags;
+    
+    union
+      {
+        // hash of the contents of a static string, or cached hash of a
+        // dynamic string (zero until computed, see p_value_hash ()).
+        unsigned int hash;
+        
+        // number of elements in front of the first element of an array,
+        // left unused by shift.  The payload starts that many elements
+        // before val.arr.data, and holds off + val.arr.cap elements.
+        unsigned int off;
+      };
   };
   
   /* 
-   * Removes GC protection from the specified value.
+   * The two halves of a rope string.  Each is either a static string or a
+   * reference to a dynamic string (which may be a rope itself).
+   * 
+   * Short strings appended to a rope are copied into a tail string
+   * (PF_TAIL) on its right, which has room to grow.  Ropes sharing a tail
+   * use as many of its characters as their length leaves for the right half,
+   * so appending to the tail never changes an existing rope.
    */
-  void p_value_unprotect (p_value *val);
+  struct p_rope
+  {
+    p_value left;
+    p_value right;
+    unsigned int depth;   // levels of ropes below this one, plus one
+  };
+  
+  /* 
+   * Returns the length of the specified in-place string.  The count of unused
+   * bytes is zero for a full string, so it doubles as its null terminator.
+   */
+  inline unsigned int
+  p_istr_len (const p_value& val)
+    { return ISTR_MAX_LEN - (unsigned char)val.val.istr[ISTR_MAX_LEN]; }
+  
+  /* 
+   * Returns an in-place string holding the "len" (at most ISTR_MAX_LEN)
+   * characters pointed to by "data".
+   */
+  p_value p_value_make_istr (const char *data, unsigned int len);
   
   /* 
    * Performs a shallow copy.
@@ -108,6 +188,24 @@ namespace arane {
    */  
   std::string p_value_str (p_value& val);
   
+  /* 
+   * Writes the textual representation of the specified value to an output
+   * buffer, without building the string in memory first where possible.
+   */
+  void p_value_write (output_writer& out, p_value& val);
+  
+  /* 
+   * Turns the specified rope string (or reference to it) into a regular
+   * string, in place.  Does nothing for other values.
+   */
+  void p_value_flatten (p_value& val, virtual_machine& vm);
+  
+  /* 
+   * Returns the hash of the contents of the specified string (or reference
+   * to it).  Dynamic strings cache their hash until modified.
+   */
+  unsigned int p_value_hash (p_value& val);
+  
   /*
    * Checks whether the contents of the two specified values are references
    * to the same data.
@@ -160,6 +258,32 @@ namespace arane {
   p_value p_value_mod (p_value& a, p_value& b, virtual_machine& vm);
   
   p_value p_value_concat (p_value& a, p_value& b, virtual_machine& vm);
+  
+  /* 
+   * Concatenates "count" consecutive values into a single new string.
+   */
+  p_value p_value_concat_n (p_value *vals, unsigned int count,
+    virtual_machine& vm);
+  
+  /* 
+   * Appends "val" to the string held by the local variable "var", in place
+   * if the string is not shared (see PF_UNIQUE).
+   */
+  void p_value_append (p_value& var, p_value& val, virtual_machine& vm);
+  
+  /* 
+   * Must be called whenever a value is stored somewhere it outlives the
+   * expression that produced it (another variable, an array, a parameter),
+   * so that a string built by p_value_append () is no longer extended in
+   * place under the new holder.  Merely reading a variable does not count.
+   */
+  inline void
+  p_value_share (const p_value& val)
+  {
+    if (val.type == PERL_REF && val.val.ref
+      && (val.val.ref->flags & PF_UNIQUE))
+      val.val.ref->flags &= ~PF_UNIQUE;
+  }
 }
 
 #endif
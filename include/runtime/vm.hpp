@@ -22,15 +22,20 @@
 #include "linker/executable.hpp"
 #include "runtime/value.hpp"
 #include "runtime/gc.hpp"
+#include "runtime/output.hpp"
 #include "runtime/types.hpp"
 #include <ostream>
 #include <istream>
 #include <stdexcept>
 #include <unordered_map>
+#include <vector>
 
 
 namespace arane {
   
+// number of values in the runtime stack.
+#define STACK_SIZE        4096
+  
   class vm_error: public std::runtime_error
   {
   public:
@@ -64,7 +69,12 @@ namespace arane {
     
     std::unordered_map<std::string, p_value> globs;
     
-    std::ostream *out;
+    // used to find the live local variables of the active frames:
+    std::vector<stack_map> smaps;       // sorted by start position
+    const unsigned char *code;
+    const unsigned char **pc;           // current instruction pointer
+    
+    output_writer out;
     std::istream *in;
     
     garbage_collector gc;
@@ -73,9 +83,16 @@ namespace arane {
     inline garbage_collector& get_gc () { return this->gc; }
     
   public:
-    virtual_machine ();
+    virtual_machine (const gc::gc_options& gc_opts = gc::gc_options ());
     ~virtual_machine ();
     
+  private:
+    /* 
+     * Flags the stack slots of local variables whose scope has been left
+     * in any of the active frames.
+     */
+    void find_dead_locals (std::vector<bool>& dead) const;
+    
   public:
     void set_in (std::istream *strm);
     void set_out (std::ostream *strm);
@@ -86,6 +86,25 @@ namespace arane {
           return ti;
         }
     }
+    
+    
+    
+    /* 
+     * Hashes the specified string (FNV-1a).  Never returns zero, which marks
+     * hashes that have not been computed yet.
+     */
+    unsigned int
+    str_hash (const char *str, unsigned int len)
+    {
+      unsigned int h = 2166136261U;
+      for (unsigned int i = 0; i < len; ++i)
+        {
+          h ^= (unsigned char)str[i];
+          h *= 16777619U;
+        }
+      
+      return h ? h : 1;
+    }
   }
 }
 
@@ -305,6 +305,51 @@ namespace arane {
   
   
   
+  /* 
+   * Compiles a statement of the form `$s ~= <expr>' (or `$s = $s ~ <expr>')
+   * where $s is a local variable into an append instruction, which extends
+   * the variable's string in place when it is not shared.  Since the result
+   * is discarded, nothing is left on the stack.
+   * 
+   * Returns false if the statement does not have the right form, in which
+   * case nothing is emitted.
+   */
+  bool
+  compiler::compile_append_stmt (ast_binop *ast)
+  {
+    if (ast->get_op () != AST_BINOP_ASSIGN
+      || ast->get_lhs ()->get_type () != AST_IDENT
+      || ast->get_rhs ()->get_type () != AST_BINARY)
+      return false;
+    
+    ast_ident *lhs = static_cast<ast_ident *> (ast->get_lhs ());
+    ast_binop *rhs = static_cast<ast_binop *> (ast->get_rhs ());
+    if (lhs->get_ident_type () != AST_IDENT_SCALAR
+      || rhs->get_op () != AST_BINOP_CONCAT
+      || rhs->get_lhs ()->get_type () != AST_IDENT)
+      return false;
+    
+    ast_ident *src = static_cast<ast_ident *> (rhs->get_lhs ());
+    if (src->get_ident_type () != AST_IDENT_SCALAR
+      || src->get_name () != lhs->get_name ())
+      return false;
+    
+    variable *var = this->top_frame ().get_local (lhs->get_name ());
+    if (!var)
+      return false;
+    
+    // the variable must be able to hold a string as is
+    if (!var->type.is_none ()
+      && this->deduce_type (rhs).check_compatibility (var->type) != TC_COMPATIBLE)
+      return false;
+    
+    this->compile_expr (rhs->get_rhs ());
+    this->cgen->emit_append (var->index);
+    return true;
+  }
+  
+  
+  
   static bool
   _is_declarative_unop (ast_named_unop *unop)
   {
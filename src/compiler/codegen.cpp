@@ -344,6 +344,13 @@ namespace arane {
     this->buf.put_byte (0x15);
   }
   
+  void
+  code_generator::emit_concat_n (unsigned short count)
+  {
+    this->buf.put_byte (0x16);
+    this->buf.put_short (count);
+  }
+  
   void
   code_generator::emit_ref ()
   {
@@ -663,6 +670,21 @@ namespace arane {
     this->buf.put_byte (0x6D);
   }
   
+  void
+  code_generator::emit_append (unsigned int index)
+  {
+    if (index <= 0xFF)
+      {
+        this->buf.put_byte (0x6E);
+        this->buf.put_byte (index);
+      }
+    else
+      {
+        this->buf.put_byte (0x6F);
+        this->buf.put_int (index);
+      }
+  }
+  
   
   
   void
@@ -678,6 +700,7 @@ namespace arane {
       { "pop", 0x202 },
       { "shift", 0x203 },
       { "range", 0x204 },
+      { "unshift", 0x205 },
       
       /*
       { "print", 1 },
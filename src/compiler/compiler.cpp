@@ -19,6 +19,7 @@
 #include "compiler/compiler.hpp"
 #include "compiler/codegen.hpp"
 #include "compiler/frame.hpp"
+#include "common/utils.hpp"
 
 #include <iostream> // DEBUG
 #include <fstream> // DEBUG
@@ -61,11 +62,39 @@ namespace arane {
       this->frms.empty () ? nullptr : this->frms.back ());
     this->frms.push_back (frm);
     this->all_frms.push_back (frm);
+    
+    if (type != FT_SUBROUTINE)
+      {
+        // locals allocated inside this frame go out of scope (and become
+        // dead) as soon as execution leaves the frame's code.
+        frm->extra["scope_start"] = this->cgen->create_and_mark_label ();
+        frm->extra["first_loc"] = frm->get_loc_count ();
+      }
   }
   
   void
   compiler::pop_frame ()
   {
+    frame *frm = this->frms.back ();
+    if (frm->get_type () != FT_SUBROUTINE)
+      {
+        int first_loc = frm->extra["first_loc"];
+        int loc_count = frm->get_loc_count () - first_loc;
+        if (loc_count > 0)
+          {
+            frame *sub_frm = frm->get_parent ();
+            while (sub_frm->get_type () != FT_SUBROUTINE)
+              sub_frm = sub_frm->get_parent ();
+            
+            c_scope sc;
+            sc.start = frm->extra["scope_start"];
+            sc.end = this->cgen->create_and_mark_label ();
+            sc.first_loc = first_loc;
+            sc.loc_count = loc_count;
+            this->smaps[sub_frm->extra["stack_map"]].scopes.push_back (sc);
+          }
+      }
+    
     this->frms.pop_back ();
   }
   
@@ -215,7 +244,10 @@ namespace arane {
     if (itr != this->data_str_map.end ())
       return itr->second;
     
+    // the string's hash precedes its index, so that the virtual machine can
+    // compare literals without hashing them at run time.
     auto& data = this->mod->get_section ("data")->data;
+    data.put_int (utils::str_hash (str.c_str (), str.length ()));
     unsigned int index = data.get_pos ();
     data.put_int (str.length ());
     data.put_bytes ((const unsigned char *)str.c_str (),
@@ -335,6 +367,24 @@ namespace arane {
             break;
           }
       }
+    
+    for (auto& csmap : this->smaps)
+      {
+        stack_map smap;
+        smap.start = this->cgen->get_label_pos (csmap.start);
+        smap.end = this->cgen->get_label_pos (csmap.end);
+        for (auto& csc : csmap.scopes)
+          {
+            local_scope sc;
+            sc.start = this->cgen->get_label_pos (csc.start);
+            sc.end = this->cgen->get_label_pos (csc.end);
+            sc.first_loc = csc.first_loc;
+            sc.loc_count = csc.loc_count;
+            smap.scopes.push_back (sc);
+          }
+        
+        this->mod->add_stack_map (smap);
+      }
   }
   
   
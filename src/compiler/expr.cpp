@@ -21,6 +21,7 @@
 #include "compiler/frame.hpp"
 #include "common/utils.hpp"
 #include <stdexcept>
+#include <vector>
 
 #include <iostream> // DEBUG
 
@@ -120,7 +121,7 @@ namespace arane {
   void
   compiler::compile_interp_string (ast_interp_string *ast)
   {
-    bool init = true;
+    unsigned int parts = 0;
     auto& entries = ast->get_entries ();
     if (entries.empty ())
       {
@@ -143,12 +144,18 @@ namespace arane {
         else
           this->compile_expr (ent.val.expr);
         
-        if (!init)
-          this->cgen->emit_concat ();
-        init = false;
+        // all parts are joined in a single pass by one concat_n instruction
+        if (++ parts == 0xFFFF)
+          {
+            this->cgen->emit_concat_n (parts);
+            parts = 1;
+          }
       }
     
-    this->cgen->emit_to_str ();
+    if (parts > 1)
+      this->cgen->emit_concat_n (parts);
+    else
+      this->cgen->emit_to_str ();
   }
   
   
@@ -386,6 +393,27 @@ namespace arane {
   }
   
   
+  /* 
+   * Collects the operands of a chain of concatenations (e.g. $a ~ $b ~ $c),
+   * from left to right.
+   */
+  static void
+  _flatten_concat (ast_expr *ast, std::vector<ast_expr *>& parts)
+  {
+    if (ast->get_type () == AST_BINARY)
+      {
+        ast_binop *binop = static_cast<ast_binop *> (ast);
+        if (binop->get_op () == AST_BINOP_CONCAT)
+          {
+            _flatten_concat (binop->get_lhs (), parts);
+            _flatten_concat (binop->get_rhs (), parts);
+            return;
+          }
+      }
+    
+    parts.push_back (ast);
+  }
+  
   void
   compiler::compile_binop (ast_binop *ast)
   {
@@ -400,6 +428,18 @@ namespace arane {
         this->compile_cmp_binop (ast);
         return;
       }
+    else if (ast->get_op () == AST_BINOP_CONCAT)
+      {
+        std::vector<ast_expr *> parts;
+        _flatten_concat (ast, parts);
+        if (parts.size () > 2 && parts.size () < 0xFFFF)
+          {
+            for (ast_expr *part : parts)
+              this->compile_expr (part);
+            this->cgen->emit_concat_n (parts.size ());
+            return;
+          }
+      }
     
     this->compile_expr (ast->get_lhs ());
     this->compile_expr (ast->get_rhs ());
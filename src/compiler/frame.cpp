@@ -149,5 +149,18 @@ namespace arane {
   {
     return this->get_next_loc_index ();
   }
+  
+  /* 
+   * Returns the number of local variables allocated so far in the
+   * enclosing subroutine.
+   */
+  int
+  frame::get_loc_count () const
+  {
+    if (this->parent && this->type != FT_SUBROUTINE)
+      return this->parent->get_loc_count ();
+    
+    return this->next_loc_index;
+  }
 }
 
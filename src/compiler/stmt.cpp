@@ -19,6 +19,7 @@
 #include "compiler/compiler.hpp"
 #include "compiler/codegen.hpp"
 #include "common/utils.hpp"
+#include <stdexcept>
 
 
 namespace arane {
@@ -27,6 +28,10 @@ namespace arane {
   compiler::compile_expr_stmt (ast_expr_stmt *ast)
   {
     ast_expr *inner = ast->get_expr ();
+    if (inner->get_type () == AST_BINARY
+      && this->compile_append_stmt (static_cast<ast_binop *> (inner)))
+      return;
+    
     this->compile_expr (inner);
     this->cgen->emit_pop ();
   }
@@ -213,7 +213,7 @@ namespace arane {
     static const std::unordered_set<std::string> _set {
       "print", "say",
       
-      "elems", "push", "pop", "shift",
+      "elems", "push", "pop", "shift", "unshift",
     };
     
     auto itr = _set.find (name);
@@ -423,6 +423,14 @@ namespace arane {
       sub.marked = true;
     }
     
+    // the scopes of the subroutine's blocks are recorded in its stack map
+    // as they are popped.
+    frm.extra["stack_map"] = this->smaps.size ();
+    c_stack_map csmap;
+    csmap.start = sub.lbl;
+    csmap.end = lbl_over;
+    this->smaps.push_back (csmap);
+    
     unsigned int loc_count = ast::count_locals_needed (body);
     this->cgen->emit_push_frame (loc_count);
     
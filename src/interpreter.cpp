@@ -314,6 +314,18 @@ namespace arane {
   
   
   
+  /* 
+   * Sets the options passed on to the garbage collector of programs
+   * run by the interpreter.
+   */
+  void
+  interpreter::set_gc_options (const gc::gc_options& opts)
+  {
+    this->gc_opts = opts;
+  }
+  
+  
+  
   /* 
    * Runs the program located in the specified path.
    */
@@ -338,7 +350,7 @@ namespace arane {
     /* 
      * Run
      */
-    virtual_machine vm {};
+    virtual_machine vm { this->gc_opts };
     try
       {
         vm.run (*exec);
@@ -349,6 +361,7 @@ namespace arane {
         std::cout << "\t" << ex.what () << std::endl;
       }
     
+    this->gc_stats = vm.get_gc ().get_stats ();
     return 0;
   }
   
@@ -368,7 +381,7 @@ namespace arane {
     /* 
      * Run
      */
-    virtual_machine vm {};
+    virtual_machine vm { this->gc_opts };
     try
       {
         vm.run (*exec);
@@ -379,6 +392,7 @@ namespace arane {
         std::cout << "\t" << ex.what () << std::endl;
       }
     
+    this->gc_stats = vm.get_gc ().get_stats ();
     return 0;
   }
 }
@@ -201,12 +201,20 @@ namespace arane {
           
           case REL_DATA_CSTR:
             {
+              // equal literals of all modules share the first copy, so
+              // that the virtual machine can compare them by address.
+              const unsigned char *data = mod->get_section ("data")->data.get_data ();
+              unsigned int len = *((const unsigned int *)(data + reloc.dest));
+              std::string str { (const char *)(data + reloc.dest + 4), len };
+              unsigned int pos = this->strs.emplace (str,
+                data_start + reloc.dest).first->second;
+              
               code_buf.push ();
               code_buf.set_pos (code_start + reloc.pos);
               switch (reloc.size)
                 {
                 case 4:
-                  code_buf.put_int (data_start + reloc.dest);
+                  code_buf.put_int (pos);
                   break;
                 }
               code_buf.pop ();
@@ -269,6 +277,30 @@ namespace arane {
   
   
   
+  /* 
+   * Moves the specified module's stack maps into the executable.
+   */
+  void
+  linker::handle_stack_maps (module *mod, std::vector<module *>& prev)
+  {
+    unsigned int code_start = _sections_total_size ("code", prev);
+    
+    for (stack_map smap : mod->get_stack_maps ())
+      {
+        smap.start += code_start;
+        smap.end += code_start;
+        for (auto& sc : smap.scopes)
+          {
+            sc.start += code_start;
+            sc.end += code_start;
+          }
+        
+        this->exec->get_stack_maps ().push_back (smap);
+      }
+  }
+  
+  
+  
   /* 
    * Links the inserted modules into a standalone executable.
    * The returned object should be deleted once no longer in use.
@@ -304,6 +336,7 @@ namespace arane {
         
         this->handle_relocations (mod, processed);
         this->handle_imports (mod, processed);
+        this->handle_stack_maps (mod, processed);
         processed.push_back (mod);
       }
     
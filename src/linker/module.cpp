@@ -105,6 +105,15 @@ namespace arane {
     this->relocs.push_back (reloc);
   }
   
+  /* 
+   * Inserts the specified subroutine stack map into the module.
+   */
+  void
+  module::add_stack_map (const stack_map& smap)
+  {
+    this->smaps.push_back (smap);
+  }
+  
   /* 
    * Inserts a dependency for the specified module name.
    */
@@ -22,13 +22,51 @@
 #include <cstring>
 #include <cstdlib>
 #include <string>
+#include <fstream>
+#include <csignal>
 #include "interpreter.hpp"
+#include "runtime/heap_snapshot.hpp"
+#include "runtime/gc.hpp"
+
+
+static void
+_snapshot_signal_handler (int)
+{
+  arane::garbage_collector::request_snapshot ();
+}
+
+static int
+_analyze_heap (const char *path)
+{
+  std::ifstream fs { path };
+  if (!fs)
+    {
+      std::cout << "arane: error: could not open `" << path << "'" << std::endl;
+      return -1;
+    }
+  
+  arane::gc::heap_snapshot snap;
+  if (!snap.load (fs))
+    {
+      std::cout << "arane: error: `" << path << "' is not a valid heap snapshot"
+                << std::endl;
+      return -1;
+    }
+  
+  snap.print_report (std::cout);
+  return 0;
+}
 
 
 int
 main (int argc, char *argv[])
 {
-  std::vector<std::string> files;  
+  std::vector<std::string> files;
+  const char *expr = nullptr;
+  bool gc_stats = false;
+  
+  arane::gc::gc_options gc_opts;
+  gc_opts.load_env ();
   
   for (int i = 1; i < argc; ++i)
     {
@@ -42,6 +80,29 @@ main (int argc, char *argv[])
                   std::cout << "Arane 1.0.1 20140827" << std::endl;
                   return 0;
                 }
+              else if (std::strcmp (arg + 2, "analyze-heap") == 0)
+                {
+                  if ((i + 1) >= argc)
+                    {
+                      std::cout << "expected snapshot path after --analyze-heap option" << std::endl;
+                      return -1;
+                    }
+                  
+                  return _analyze_heap (argv[i + 1]);
+                }
+              else if (std::strcmp (arg + 2, "gc-stats") == 0)
+                gc_stats = true;
+              else if (std::strncmp (arg + 2, "gc-", 3) == 0)
+                {
+                  // --gc-<name>=<value>
+                  const char *eq = std::strchr (arg, '=');
+                  if (!eq || !gc_opts.set (std::string (arg + 5, eq - (arg + 5)), eq + 1))
+                    {
+                      std::cout << "arane: error: invalid GC option `" << arg
+                                << "'" << std::endl;
+                      return -1;
+                    }
+                }
             }
           else
             {
@@ -53,9 +114,7 @@ main (int argc, char *argv[])
                       return -1;
                     }
                   
-                  std::istringstream ss { argv[++i] };
-                  arane::interpreter interp {};
-                  return interp.interpret (ss);
+                  expr = argv[++i];
                 }
             }
         }
@@ -65,13 +124,36 @@ main (int argc, char *argv[])
         }
     }
   
-  if (files.empty ())
+  if (!expr && files.empty ())
     {
       std::cout << "arane: error: no input files" << std::endl;
       return -1;
     }
   
+  if (!gc_opts.snapshot.empty ())
+    std::signal (SIGUSR1, _snapshot_signal_handler);
+  
+  // one-liners are expected to be short-lived, so unless told otherwise,
+  // don't bother collecting garbage until they grow large.
+  if (gc_opts.arena_limit < 0)
+    gc_opts.arena_limit = expr ? GC_AUTO_ARENA_LIMIT : 0;
+  
+  // the process exits right after the program is run.
+  gc_opts.skip_teardown = true;
+  
   arane::interpreter interp {};
-  return interp.interpret (files[0]);
+  interp.set_gc_options (gc_opts);
+  
+  int ret;
+  if (expr)
+    {
+      std::istringstream ss { expr };
+      ret = interp.interpret (ss);
+    }
+  else
+    ret = interp.interpret (files[0]);
+  
+  if (gc_stats && ret == 0)
+    interp.get_gc_stats ().print (std::cerr);
+  return ret;
 }
-
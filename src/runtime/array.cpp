@@ -0,0 +1,207 @@
+/*
+ * Arane - A Perl 6 interpreter.
+ * Copyright (C) 2014 Jacob Zhitomirsky
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "runtime/array.hpp"
+#include "runtime/gc.hpp"
+#include <cstring>
+
+
+namespace arane {
+  
+  namespace array {
+    
+    p_value*
+    create (garbage_collector& gc, unsigned int len, unsigned int cap)
+    {
+      if (cap < len)
+        cap = len;
+      if (cap == 0)
+        cap = 1;
+      
+      p_value *arr = gc.alloc ();
+      arr->type = PERL_ARRAY;
+      arr->val.arr.len = len;
+      arr->val.arr.data = gc.alloc_array_data (cap);
+      arr->val.arr.cap = cap;
+      return arr;
+    }
+    
+    
+    
+    /* 
+     * Moves the elements of the specified array to the start of its payload,
+     * reclaiming the room left in front of them by shift.
+     */
+    static void
+    _rewind (p_value *arr)
+    {
+      auto& data = arr->val.arr;
+      if (!arr->off)
+        return;
+      
+      // elements move towards the start of the payload, which keeps the
+      // collector's mark cursor valid.
+      p_value *elems = data.data - arr->off;
+      std::memmove (elems, data.data, data.len * sizeof (p_value));
+      data.data = elems;
+      data.cap += arr->off;
+      arr->off = 0;
+    }
+    
+    void
+    reserve (garbage_collector& gc, p_value *arr, unsigned int need)
+    {
+      auto& data = arr->val.arr;
+      if (need <= data.cap)
+        return;
+      
+      // the room in front is only reused in place if it is at least as large
+      // as the array, so that queues move their elements once per that many
+      // operations.  otherwise the elements are moved as part of growing.
+      gc.unshare (arr);
+      bool reuse = arr->off >= data.len;
+      _rewind (arr);
+      if (reuse && need <= data.cap)
+        return;
+      
+      unsigned int cap = data.cap * 2;
+      if (cap < ARRAY_MIN_CAP)
+        cap = ARRAY_MIN_CAP;
+      if (cap < need)
+        cap = need;
+      data.data = gc.resize_array_data (data.data, data.len, data.cap, cap);
+      data.cap = cap;
+    }
+    
+    /* 
+     * Halves the payload of the specified array if no more than a quarter of
+     * it is in use.
+     */
+    static void
+    _shrink (garbage_collector& gc, p_value *arr)
+    {
+      auto& data = arr->val.arr;
+      unsigned int total = arr->off + data.cap;
+      if (total <= ARRAY_MIN_CAP || data.len > total / 4
+        || (arr->flags & PF_SHARED))
+        return;
+      
+      unsigned int cap = total / 2;
+      if (cap < ARRAY_MIN_CAP)
+        cap = ARRAY_MIN_CAP;
+      _rewind (arr);
+      data.data = gc.resize_array_data (data.data, data.len, data.cap, cap);
+      data.cap = cap;
+    }
+    
+    
+    
+    void
+    set (garbage_collector& gc, p_value *arr, unsigned int index,
+      const p_value& val)
+    {
+      gc.unshare (arr);
+      auto& data = arr->val.arr;
+      if (index >= data.len)
+        {
+          reserve (gc, arr, index + 1);
+          for (unsigned int i = data.len; i < index; ++i)
+            data.data[i].type = PERL_UNDEF;
+          data.len = index + 1;
+        }
+      else
+        gc.shade (data.data[index]);
+      
+      p_value_share (val);
+      data.data[index] = val;
+    }
+    
+    void
+    push (garbage_collector& gc, p_value *arr, const p_value& val)
+    {
+      gc.unshare (arr);
+      auto& data = arr->val.arr;
+      if (data.len == data.cap)
+        reserve (gc, arr, data.len + 1);
+      p_value_share (val);
+      data.data[data.len ++] = val;
+    }
+    
+    p_value
+    pop (garbage_collector& gc, p_value *arr)
+    {
+      // only the length changes, so the payload can stay shared.
+      auto& data = arr->val.arr;
+      p_value val = data.data[-- data.len];
+      gc.shade (val);
+      _shrink (gc, arr);
+      return val;
+    }
+    
+    p_value
+    shift (garbage_collector& gc, p_value *arr)
+    {
+      // the array now starts past the element.  the payload is left as it is
+      // (and may still be shared), the room in front is reused once the array
+      // grows.
+      auto& data = arr->val.arr;
+      p_value val = data.data[0];
+      gc.shade (val);
+      ++ data.data;
+      -- data.len;
+      -- data.cap;
+      ++ arr->off;
+      _shrink (gc, arr);
+      return val;
+    }
+    
+    p_value*
+    unshift (garbage_collector& gc, p_value *arr, unsigned int count)
+    {
+      gc.unshare (arr);
+      auto& data = arr->val.arr;
+      if (arr->off < count)
+        {
+          // move the elements into a new payload with as much room in front
+          // of them as the array will hold, which makes unshift amortized
+          // O(1).
+          unsigned int front = data.len + count;
+          unsigned int total = front + count + data.cap;
+          p_value *elems = gc.alloc_array_data (total);
+          std::memcpy (elems + front + count, data.data,
+            data.len * sizeof (p_value));
+          gc.free_payload (data.data - arr->off,
+            (arr->off + data.cap) * sizeof (p_value));
+          
+          data.data = elems + front + count;
+          data.cap = total - (front + count);
+          arr->off = front + count;
+          
+          // the elements moved towards the end of the payload.
+          gc.rescan (arr);
+        }
+      
+      data.data -= count;
+      data.len += count;
+      data.cap += count;
+      arr->off -= count;
+      return data.data;
+    }
+  }
+}
+
@@ -19,6 +19,7 @@
 #include "runtime/builtins.hpp"
 #include "runtime/vm.hpp"
 #include "runtime/value.hpp"
+#include "runtime/array.hpp"
 #include <cstring>
 
 
@@ -64,27 +65,10 @@ namespace arane {
           val.val.ref->type == PERL_ARRAY))
       throw vm_error ("first parameter passed to builtin `push' is not an array");
     
-    auto& data = val.val.ref->val.arr;
-    if ((data.len + (param_count - 1)) > data.cap)
-      {
-        // resize array
-        
-        unsigned int ncap = data.len * 2;
-        if ((data.len + (param_count - 1)) > ncap)
-          ncap += param_count - 1;
-        
-        p_value *vals = new p_value [ncap];
-        for (unsigned int i = 0; i < data.len; ++i)
-          vals[i] = data.data[i];
-        delete[] data.data;
-        data.data = vals;
-        
-        vm.gc.notify_increase ((ncap - data.cap) * sizeof (p_value));
-        data.cap = ncap;
-      }
-    
+    p_value *obj = val.val.ref;
+    array::reserve (vm.gc, obj, obj->val.arr.len + (param_count - 1));
     for (int i = 1; i < param_count; ++i)
-      data.data[data.len ++] = stack[sp - 1 - i];
+      array::push (vm.gc, obj, stack[sp - 1 - i]);
     
     sp -= param_count;
     stack[sp++] = val;
@@ -107,12 +91,12 @@ namespace arane {
           val.val.ref->type == PERL_ARRAY))
       throw vm_error ("parameter passed to builtin `pop' is not an array");
     
-    auto& data = val.val.ref->val.arr;
-    if (data.len == 0)
+    p_value *obj = val.val.ref;
+    if (obj->val.arr.len == 0)
       throw vm_error ("array passed to builtin `pop' is empty");
     
     sp -= param_count;
-    stack[sp++] = data.data[-- data.len];
+    stack[sp++] = array::pop (vm.gc, obj);
   }
   
   
@@ -132,16 +116,41 @@ namespace arane {
           val.val.ref->type == PERL_ARRAY))
       throw vm_error ("parameter passed to builtin `shift' is not an array");
     
-    auto& data = val.val.ref->val.arr;
-    if (data.len == 0)
+    p_value *obj = val.val.ref;
+    if (obj->val.arr.len == 0)
       throw vm_error ("array passed to builtin `shift' is empty");
     
     sp -= param_count;
-    stack[sp++] = data.data[0];
+    stack[sp++] = array::shift (vm.gc, obj);
+  }
+  
+  
+  
+  void
+  builtins::unshift (virtual_machine& vm, int param_count)
+  {
+    auto stack = vm.stack;
+    int& sp    = vm.sp;
+    
+    if (param_count < 2)
+      throw vm_error ("builtin `unshift' expects at least 2 parameters");
     
-    // shift array
-    -- data.len;
-    std::memmove (data.data, data.data + 1, data.len * sizeof (p_value));
+    auto& val = stack[sp - 1];
+    if (!(val.type == PERL_REF &&
+          val.val.ref &&
+          val.val.ref->type == PERL_ARRAY))
+      throw vm_error ("first parameter passed to builtin `unshift' is not an array");
+    
+    unsigned int count = param_count - 1;
+    p_value *elems = array::unshift (vm.gc, val.val.ref, count);
+    for (unsigned int i = 0; i < count; ++i)
+      {
+        p_value_share (stack[sp - 2 - i]);
+        elems[i] = stack[sp - 2 - i];
+      }
+    
+    sp -= param_count;
+    stack[sp++] = val;
   }
   
   
@@ -171,12 +180,8 @@ namespace arane {
     long long count = (rhs < lhs) ? 0 : (rhs - lhs + 1);
     
     // create array
-    p_value *data = vm.gc.alloc (true);
-    data->type = PERL_ARRAY;
+    p_value *data = array::create (vm.gc, count);
     auto& arr = data->val.arr;
-    unsigned int cap = count ? count : 1;
-    arr.len = count;
-    arr.data = new p_value [cap];
     for (int i = 0; i < count; ++i)
       {
         auto& val = arr.data[i];
@@ -32,8 +32,9 @@ namespace arane {
     for (int i = 0; i < param_count; ++i)
       {
         auto& val = stack[sp - 1 - i];
-        *vm.out << p_value_str (val);
+        p_value_write (vm.out, val);
       }
+    vm.out.sync ();
     
     sp -= param_count;
     stack[sp++].type = PERL_UNDEF;
@@ -50,9 +51,9 @@ namespace arane {
     for (int i = 0; i < param_count; ++i)
       {
         auto& val = stack[sp - 1 - i];
-        *vm.out << p_value_str (val);
+        p_value_write (vm.out, val);
       }
-    *vm.out << std::endl;
+    vm.out.end_line ();
     
     sp -= param_count;
     stack[sp++].type = PERL_UNDEF;
@@ -19,15 +19,55 @@
 #include "runtime/gc.hpp"
 #include "runtime/vm.hpp"
 #include <gmp.h>
+#include <cstring>
+#include <cstdlib>
+#include <climits>
+#include <chrono>
+#include <fstream>
+#include <unordered_map>
+#include <csignal>
+#include <new>
+#include <sys/mman.h>
 
 #include <iostream> // DEBUG
 
 
 namespace arane {
   
+// default values for gc_options:
 #define GC_MARK_LIMIT         2048
 #define GC_SWEEP_LIMIT          12
 #define GC_ALLOC_THRESHOLD     128
+#define GC_EXT_TRIGGER    67108864    // 64MB
+#define GC_TARGET_OVERHEAD     100    // percent
+#define GC_TARGET_PAUSE       1000    // microseconds
+#define GC_PAGE_POOL            64    // pages
+#define GC_PAGE_IDLE_CYCLES      4
+#define GC_COMPACT               0    // percent (disabled)
+
+// minimum number of sparse pages left behind by a cycle that makes
+// compaction worthwhile.
+#define GC_COMPACT_MIN_PAGES     4
+
+// the GCP_HEAP pacer never aims for a heap smaller than this.
+#define GC_MIN_HEAP_GOAL   4194304    // 4MB
+
+// how many marked objects sweeping a single page is considered to be worth.
+#define GC_SWEEP_PAGE_COST     128
+
+// number of gray objects prefetched ahead of the one being scanned
+// (must be a power of two).
+#define GC_PREFETCH_DISTANCE     8
+
+// maximum number of array elements scanned at once, and how many scanned
+// elements count as one unit of marking work.
+#define GC_ARRAY_SCAN_CHUNK   1024
+#define GC_ELEMS_PER_UNIT       16
+
+// maximum number of destroyed integers kept for reuse, and the size (in
+// limbs) above which an integer is not worth keeping.
+#define GC_BINT_POOL_SIZE      128
+#define GC_BINT_POOL_LIMBS     512
 
 
 //#define GC_DEBUG
@@ -40,33 +80,299 @@ namespace arane {
   
   namespace {
     
-    enum: unsigned char
+    /* 
+     * Object liveness is kept in a side bitmap in every page rather than in
+     * the objects themselves, so sweeping a page only has to touch the
+     * memory of objects that are actually dead.
+     * 
+     * Because this is an incremental GC, objects allocated in between the
+     * phases of a cycle have their mark bit set right away (they are
+     * allocated "black"), and so they survive the cycle they were created in.
+     * All mark bits are cleared at the beginning of the next cycle.
+     */
+    
+    // summary word with a bit set for every word in the free bitmap.
+    static inline unsigned long long
+    _full_summary ()
+    {
+      return (GC_BITMAP_WORDS == 64) ? ~0ULL : ((1ULL << GC_BITMAP_WORDS) - 1);
+    }
+  }
+  
+  
+  
+  namespace gc {
+    
+    gc_options::gc_options ()
+    {
+      this->mark_limit = GC_MARK_LIMIT;
+      this->sweep_limit = GC_SWEEP_LIMIT;
+      this->alloc_threshold = GC_ALLOC_THRESHOLD;
+      this->ext_trigger = GC_EXT_TRIGGER;
+      this->pacer = GCP_FIXED;
+      this->target_overhead = GC_TARGET_OVERHEAD;
+      this->target_pause = GC_TARGET_PAUSE;
+      this->page_pool = GC_PAGE_POOL;
+      this->page_idle_cycles = GC_PAGE_IDLE_CYCLES;
+      this->compact = GC_COMPACT;
+      this->arena_limit = -1;
+      this->skip_teardown = false;
+      this->snapshot_at = 0;
+    }
+    
+    
+    
+    // parses a non-negative integer with an optional k/m/g suffix.
+    static bool
+    _parse_size (const std::string& str, long long& out)
     {
-      /* 
-       * Because this is an incremental GC, should new objects be allocated
-       * in between the phases, they could be deleted even though they might be
-       * live objects.
-       * 
-       * To prevent this, there are two types of white objects - one
-       * representing white objects that are canditates to be reclaimed in the
-       * current GC cycle, and another white type for newly created objects.
-       * 
-       * Following how it's done in mruby, instead of toggling the type of
-       * every white object individually, the meaning of what type of white
-       * object is what is toggled instead, which is much cheaper to do.
-       */
-      GC_WHITE_A = 0,
-      GC_WHITE_B = 1,
+      if (str.empty () || !(str[0] >= '0' && str[0] <= '9'))
+        return false;
       
-      GC_GRAY,
-      GC_BLACK,
-    };
+      char *end;
+      long long n = std::strtoll (str.c_str (), &end, 10);
+      switch (*end)
+        {
+        case 'k': case 'K': n <<= 10; ++ end; break;
+        case 'm': case 'M': n <<= 20; ++ end; break;
+        case 'g': case 'G': n <<= 30; ++ end; break;
+        default: ;
+        }
+      if (*end != '\0')
+        return false;
+      
+      out = n;
+      return true;
+    }
+    
+    /* 
+     * Sets the option with the specified name (e.g. "mark-limit") from its
+     * textual representation.  Returns false if either the name or the
+     * value are invalid.
+     */
+    bool
+    gc_options::set (const std::string& name, const std::string& value)
+    {
+      if (name == "snapshot")
+        {
+          this->snapshot = value;
+          return !value.empty ();
+        }
+      
+      if (name == "pacer")
+        {
+          if (value == "fixed")
+            this->pacer = GCP_FIXED;
+          else if (value == "heap")
+            this->pacer = GCP_HEAP;
+          else if (value == "pause")
+            this->pacer = GCP_PAUSE;
+          else
+            return false;
+          return true;
+        }
+      
+      long long n;
+      if (!_parse_size (value, n))
+        return false;
+      
+      if (name == "ext-trigger")
+        {
+          this->ext_trigger = n;
+          return true;
+        }
+      else if (name == "page-pool")
+        {
+          if (n > 0x7FFFFFFF)
+            return false;
+          this->page_pool = n;
+          return true;
+        }
+      else if (name == "snapshot-at")
+        {
+          this->snapshot_at = n;
+          return true;
+        }
+      else if (name == "arena-limit")
+        {
+          this->arena_limit = n;
+          return true;
+        }
+      else if (name == "compact")
+        {
+          if (n > 100)
+            return false;
+          this->compact = n;
+          return true;
+        }
+      
+      if (n <= 0 || n > 0x7FFFFFFF)
+        return false;
+      if (name == "mark-limit")
+        this->mark_limit = n;
+      else if (name == "sweep-limit")
+        this->sweep_limit = n;
+      else if (name == "alloc-threshold")
+        this->alloc_threshold = n;
+      else if (name == "target-overhead")
+        this->target_overhead = n;
+      else if (name == "target-pause")
+        this->target_pause = n;
+      else if (name == "page-idle-cycles")
+        this->page_idle_cycles = n;
+      else
+        return false;
+      
+      return true;
+    }
+    
+    /* 
+     * Reads options from ARANE_GC_* environment variables
+     * (e.g. ARANE_GC_MARK_LIMIT).
+     */
+    void
+    gc_options::load_env ()
+    {
+      static const char *names[] = {
+        "mark-limit", "sweep-limit", "alloc-threshold", "ext-trigger",
+        "pacer", "target-overhead", "target-pause", "snapshot",
+        "snapshot-at", "page-pool", "page-idle-cycles",
+        "arena-limit", "compact",
+      };
+      
+      for (const char *name : names)
+        {
+          std::string var = "ARANE_GC_";
+          for (const char *p = name; *p; ++p)
+            var.push_back ((*p == '-') ? '_' : (*p - 'a' + 'A'));
+          
+          const char *value = std::getenv (var.c_str ());
+          if (value && !this->set (name, value))
+            std::cerr << "arane: warning: ignoring invalid value of "
+                      << var << std::endl;
+        }
+    }
+    
+    
+    
+    gc_stats::gc_stats ()
+    {
+      this->cycles = this->full_collections = this->steps = 0;
+      this->mark_time = this->sweep_time = 0;
+      this->last_mark_time = this->last_sweep_time = 0;
+      this->max_pause = this->total_pause = 0;
+      for (int i = 0; i < GC_PAUSE_BUCKETS; ++i)
+        this->pause_hist[i] = 0;
+      
+      this->objs_allocated = this->objs_freed = this->bytes_freed = 0;
+      this->last_objs_freed = this->last_bytes_freed = 0;
+      this->live_objs = this->objs = 0;
+      
+      this->pages = this->peak_pages = this->total_pages = 0;
+      this->pooled_pages = this->released_pages = this->mapped_bytes = 0;
+      this->payload_slabs = 0;
+      this->large_objects = this->large_bytes = 0;
+      this->compactions = this->objs_moved = this->pages_compacted = 0;
+      this->ext_bytes = this->peak_ext_bytes = this->total_ext_bytes = 0;
+      this->run_time = 0;
+      this->in_arena = false;
+    }
+    
+    
+    /* 
+     * Returns the amount of bytes (objects and payloads) allocated per
+     * second.
+     */
+    double
+    gc_stats::alloc_rate () const
+    {
+      if (this->run_time <= 0)
+        return 0.0;
+      
+      double bytes = (double)this->objs_allocated * sizeof (p_value)
+        + this->total_ext_bytes;
+      return bytes / (this->run_time / 1e9);
+    }
+    
     
+    static inline double
+    _usecs (long long nsecs)
+      { return nsecs / 1e3; }
     
-    static inline unsigned char
-    _opposite_white (unsigned char type)
+    static inline double
+    _msecs (long long nsecs)
+      { return nsecs / 1e6; }
+    
+    /* 
+     * Prints a human-readable report to the specified stream.
+     */
+    void
+    gc_stats::print (std::ostream& strm) const
     {
-      return type ^ 1;
+      auto flags = strm.flags ();
+      auto prec = strm.precision ();
+      strm.setf (std::ios::fixed, std::ios::floatfield);
+      strm.precision (3);
+      
+      strm << "GC statistics:" << std::endl;
+      strm << "  cycles:          " << this->cycles << " ("
+           << this->full_collections << " full collections)" << std::endl;
+      strm << "  mark time:       " << _msecs (this->mark_time) << "ms total, "
+           << _msecs (this->last_mark_time) << "ms last cycle" << std::endl;
+      strm << "  sweep time:      " << _msecs (this->sweep_time) << "ms total, "
+           << _msecs (this->last_sweep_time) << "ms last cycle" << std::endl;
+      strm << "  pauses:          " << this->steps << ", avg "
+           << _usecs (this->steps ? (this->total_pause / this->steps) : 0)
+           << "us, max " << _usecs (this->max_pause) << "us" << std::endl;
+      strm << "  objects:         " << this->objs_allocated << " allocated, "
+           << this->objs_freed << " freed, " << this->objs << " in heap, "
+           << this->live_objs << " live after last mark" << std::endl;
+      strm << "  bytes freed:     " << this->bytes_freed << " total, "
+           << this->last_bytes_freed << " last cycle ("
+           << this->last_objs_freed << " objects)" << std::endl;
+      strm << "  pages:           " << this->pages << " live, "
+           << this->peak_pages << " peak, " << this->total_pages << " total"
+           << std::endl;
+      strm << "  page pool:       " << this->pooled_pages << " pooled, "
+           << this->released_pages << " released, " << this->mapped_bytes
+           << " bytes mapped" << std::endl;
+      strm << "  external bytes:  " << this->ext_bytes << " live, "
+           << this->peak_ext_bytes << " peak, " << this->total_ext_bytes
+           << " total (" << this->payload_slabs << " slabs)" << std::endl;
+      strm << "  large objects:   " << this->large_objects << " ("
+           << this->large_bytes << " bytes)" << std::endl;
+      if (this->compactions)
+        strm << "  compaction:      " << this->compactions << " runs, "
+             << this->objs_moved << " objects moved, "
+             << this->pages_compacted << " pages freed" << std::endl;
+      if (this->in_arena)
+        strm << "  arena:           never left" << std::endl;
+      strm << "  allocation rate: " << (this->alloc_rate () / 1048576.0)
+           << "MB/s over " << _msecs (this->run_time) << "ms" << std::endl;
+      
+      strm << "  pause histogram:" << std::endl;
+      for (int i = 0; i < GC_PAUSE_BUCKETS; ++i)
+        {
+          if (this->pause_hist[i] == 0)
+            continue;
+          
+          std::string label;
+          if (i == 0)
+            label = "< 1us";
+          else if (i == GC_PAUSE_BUCKETS - 1)
+            label = ">= " + std::to_string (1LL << (i - 1)) + "us";
+          else
+            label = std::to_string (1LL << (i - 1)) + "-"
+              + std::to_string (1LL << i) + "us";
+          
+          strm << "    ";
+          strm.width (14);
+          strm << label;
+          strm << ": " << this->pause_hist[i] << std::endl;
+        }
+      
+      strm.flags (flags);
+      strm.precision (prec);
     }
   }
   
@@ -76,36 +382,61 @@ namespace arane {
    * Constructs a garbage collector on top of the specified runtime stack.
    * The given stack will function as the collector's "root" set.
    */
-  garbage_collector::garbage_collector (virtual_machine& vm)
-    : vm (vm)
+  garbage_collector::garbage_collector (virtual_machine& vm,
+    const gc::gc_options& opts)
+    : vm (vm), opts (opts)
   {
     this->pages = nullptr;
     this->page_count = 0;
     this->total_page_count = 0;
     
+    this->in_arena = opts.arena_limit > 0;
+    this->bump = 0;
+    
     // create the initial page
     auto page = this->alloc_page ();
     this->link_page (page);
     
     this->state = gc::GCS_NONE;
-    this->curr_white = GC_WHITE_A;
     this->alloc_count = 0;
     this->total_alloc_count = 0;
     this->counter = 0;
     
     this->total_ext_bytes = this->ext_bytes = this->last_ext_bytes = 0;
     this->inc_count = 0;
+    this->obj_count = 0;
+    
+    this->mark_budget = opts.mark_limit;
+    this->sweep_budget = opts.sweep_limit;
+    this->swept_pages = 0;
+    this->live_objs = 0;
+    this->live_bytes = 0;
+    this->last_heap_size = 0;
+    this->pause_scale = 1.0;
+    this->sparse_pages = 0;
+    this->compact_pending = false;
+    
+    this->cycle_mark_time = this->cycle_sweep_time = 0;
+    this->cycle_objs_freed = this->cycle_bytes_freed = 0;
+    this->last_work_time = 0;
+    this->snapshot_taken = false;
+    this->start_time = std::chrono::steady_clock::now ();
+    
+    this->hook_gmp ();
   }
   
   garbage_collector::~garbage_collector ()
   {
-    /*
-    std::cout << "total_ext_bytes: " << this->total_ext_bytes << std::endl;
-    std::cout << "avg increase: " << (this->total_ext_bytes / this->inc_count) << std::endl;
-    std::cout << "page count: " << this->page_count << std::endl;
-    std::cout << "total page count: " << this->total_page_count << std::endl;
-    std::cout << "total alloc count: " << this->total_alloc_count << std::endl;
-    */
+    if (this->opts.skip_teardown)
+      {
+        // the integers that are still alive are never freed.
+        this->unhook_gmp ();
+        return;
+      }
+    
+    if (this->in_arena)
+      this->leave_arena ();
+    
     auto page = this->pages;
     while (page)
       {
@@ -113,6 +444,13 @@ namespace arane {
         this->free_page (page);
         page = next;
       }
+    
+    for (auto& n : this->bint_pool)
+      mpz_clear (&n);
+    this->unhook_gmp ();
+    
+    for (void *chunk : this->chunks)
+      munmap (chunk, GC_CHUNK_BYTES);
   }
   
   
@@ -128,18 +466,120 @@ namespace arane {
   gc::heap_page*
   garbage_collector::alloc_page ()
   {
-    gc::heap_page *page = new gc::heap_page;
+    // prefer recently pooled pages, whose memory is likely still cached.
+    gc::heap_page *page;
+    if (!this->pool.empty ())
+      {
+        page = this->pool.back ();
+        this->pool.pop_back ();
+      }
+    else
+      {
+        if (this->released.empty ())
+          this->alloc_chunk ();
+        page = this->released.back ();
+        this->released.pop_back ();
+      }
     
     page->prev = nullptr;
     page->next = nullptr;
+    page->evacuating = false;
+    
+    if (this->in_arena)
+      {
+        // arena pages are handed out in order, so they are marked as fully
+        // used up front, and only the unused tail of the last one has to be
+        // fixed up once the arena is left.
+        for (unsigned int i = 0; i < GC_BITMAP_WORDS; ++i)
+          {
+            page->free_bitmap[i] = 0;
+            page->mark_bitmap[i] = 0;
+          }
+        page->free_summary = 0;
+        return page;
+      }
     
     // mark all objects in the page as free
-    for (unsigned int i = 0; i < sizeof page->free_bitmap; ++i)
-      page->free_bitmap[i] = 0xFF;
+    for (unsigned int i = 0; i < GC_BITMAP_WORDS; ++i)
+      {
+        page->free_bitmap[i] = ~0ULL;
+        page->mark_bitmap[i] = 0;
+      }
+    page->free_summary = _full_summary ();
     
     return page;
   }
   
+  /* 
+   * Maps a new chunk of memory and adds its pages to the released list.
+   */
+  void
+  garbage_collector::alloc_chunk ()
+  {
+    // map twice the size needed and trim the excess so that the chunk (and
+    // thus every page in it) is aligned to its size.
+    size_t size = GC_CHUNK_BYTES * 2;
+    void *mem = mmap (nullptr, size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+      throw std::bad_alloc ();
+    
+    unsigned long start = (unsigned long)mem;
+    unsigned long aligned = (start + GC_CHUNK_BYTES - 1)
+      & ~((unsigned long)GC_CHUNK_BYTES - 1);
+    if (aligned > start)
+      munmap (mem, aligned - start);
+    if (aligned + GC_CHUNK_BYTES < start + size)
+      munmap ((void *)(aligned + GC_CHUNK_BYTES),
+        (start + size) - (aligned + GC_CHUNK_BYTES));
+    
+    this->chunks.push_back ((void *)aligned);
+    
+    // pushed in reverse so that pages are handed out in address order.
+    for (int i = GC_CHUNK_BYTES / GC_PAGE_BYTES - 1; i >= 0; --i)
+      this->released.push_back (
+        (gc::heap_page *)(aligned + (unsigned long)i * GC_PAGE_BYTES));
+  }
+  
+  /* 
+   * Puts the specified empty page in the page pool.
+   */
+  void
+  garbage_collector::pool_page (gc::heap_page *page)
+  {
+    page->idle_since = this->stats.cycles;
+    this->pool.push_back (page);
+  }
+  
+  /* 
+   * Returns pooled pages that have been idle for too long, or that do not
+   * fit in the pool, to the system.
+   */
+  void
+  garbage_collector::trim_pool ()
+  {
+    unsigned int j = 0;
+    unsigned int count = this->pool.size ();
+    for (unsigned int i = 0; i < count; ++i)
+      {
+        gc::heap_page *page = this->pool[i];
+        bool idle = (this->stats.cycles - page->idle_since)
+          >= this->opts.page_idle_cycles;
+        bool excess = (count - i) > this->opts.page_pool;
+        if (idle || excess)
+          {
+            // the memory stays mapped, but the system is free to reclaim
+            // the physical pages behind it (they read back as zeros).
+            madvise (page, GC_PAGE_BYTES, MADV_DONTNEED);
+            this->released.push_back (page);
+          }
+        else
+          this->pool[j++] = page;
+      }
+    
+    this->pool.resize (j);
+  }
+  
   /* 
    * Links the specified heap page to the rest.
    */
@@ -152,6 +592,8 @@ namespace arane {
     this->pages = page;
     ++ this->page_count;
     ++ this->total_page_count;
+    if (this->page_count > this->stats.peak_pages)
+      this->stats.peak_pages = this->page_count;
   }
   
   /* 
@@ -171,64 +613,48 @@ namespace arane {
   
   
   
-  static bool
+  static inline bool
   _page_space_available (gc::heap_page *page)
   {
-    unsigned int aux_size = GC_PAGE_SIZE >> 6;
-    for (unsigned int i = 0; i < aux_size; ++i)
-      if (page->free_bitmap[i])
-        return true;
-    return false;
-  }
-  
-  
-  
-  // counts consecutive zero bits on the right (index of first set lsb).
-  static int
-  _find_lsb (unsigned int v)
-  {
-    static const int _table[] = {
-      0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8, 
-      31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9
-    };
-    return _table[(unsigned int)(((v & -v) * 0x077CB531U)) >> 27];
+    return page->free_summary != 0;
   }
   
   // or -1 if not found
-  static int
+  static inline int
   _next_free_object_index (gc::heap_page *page)
   {
-    const unsigned int aux_size = GC_PAGE_SIZE >> 6;
-    
-    for (unsigned int i = 0; i < aux_size; ++i)
-      if (page->free_bitmap[i])
-        {
-          unsigned int aux_ind = _find_lsb (page->free_bitmap[i]);
-          
-          unsigned char fb = page->free_bitmap[aux_size + (i << 3) + aux_ind];
-          return (i << 6) | (aux_ind << 3) | _find_lsb (fb);
-        }
+    if (!page->free_summary)
+      return -1;
     
-    return -1;
+    unsigned int w = __builtin_ctzll (page->free_summary);
+    return (w << 6) | __builtin_ctzll (page->free_bitmap[w]);
   }
   
   // marks the object located at the specified index as used (not free).
-  static void
+  static inline void
   _mark_used (gc::heap_page *page, int index)
   {
-    const unsigned int aux_size = GC_PAGE_SIZE >> 6;
-    if ((page->free_bitmap[aux_size + (index >> 3)] &= ~(1 << (index & 7)))
-      == 0)
-      page->free_bitmap[index >> 6] &= ~(1 << ((index >> 3) & 7));
+    unsigned int w = index >> 6;
+    if ((page->free_bitmap[w] &= ~(1ULL << (index & 63))) == 0)
+      page->free_summary &= ~(1ULL << w);
   }
   
-  static void
-  _mark_free (gc::heap_page *page, int index)
+  static inline void
+  _set_mark (gc::heap_page *page, int index)
+  {
+    page->mark_bitmap[index >> 6] |= 1ULL << (index & 63);
+  }
+  
+  static inline bool
+  _is_marked (gc::heap_page *page, int index)
+  {
+    return page->mark_bitmap[index >> 6] & (1ULL << (index & 63));
+  }
+  
+  static inline bool
+  _is_free (gc::heap_page *page, int index)
   {
-    const unsigned int aux_size = GC_PAGE_SIZE >> 6;
-    if ((page->free_bitmap[aux_size + (index >> 3)] |= (1 << (index & 7)))
-      != 0)
-      page->free_bitmap[index >> 6] |= (1 << ((index >> 3) & 7));
+    return page->free_bitmap[index >> 6] & (1ULL << (index & 63));
   }
   
   
@@ -250,16 +676,42 @@ namespace arane {
   {
     if (!val)
       return;
-    if (val->gc_state == GC_GRAY)
+    
+    gc::heap_page *page = gc::page_of (val);
+    int index = val - page->objs;
+    if (_is_marked (page, index))
       return;
     
     ++ this->marked;
-    val->gc_state = GC_GRAY;
-    this->grays.push_back (val);
+    _set_mark (page, index);
+    this->grays.push (val);
+  }
+  
+  /* 
+   * Checks whether the specified reference points to a heap object
+   * (rather than to a slot in the VM's stack).
+   */
+  inline bool
+  garbage_collector::is_heap_ref (p_value *ref)
+  {
+    // the only references that do not point into the heap are the ones
+    // taken to local variables and arguments, so a range check is enough
+    // (and it does not have to touch the referenced object).
+    return ref && !(ref >= this->vm.stack && ref < this->vm.stack + STACK_SIZE);
   }
   
   
   
+  /* 
+   * Clears the mark bitmaps of all pages.
+   */
+  void
+  garbage_collector::clear_marks ()
+  {
+    for (auto page = this->pages; page; page = page->next)
+      std::memset (page->mark_bitmap, 0, sizeof page->mark_bitmap);
+  }
+  
   /* 
    * Prepares the root set by marking the root objects (stack, globals, etc...)
    */
@@ -269,33 +721,24 @@ namespace arane {
     // 
     // Stack.
     // 
+    // local variables that are out of scope can not be used anymore, and
+    // do not keep the values they hold alive.  they are cleared, since the
+    // objects they point to may be freed before the scope is entered again.
+    this->vm.find_dead_locals (this->dead_slots);
     int sp = this->vm.sp;
     for (int i = 0; i < sp; ++i)
       {
         p_value& val = this->vm.stack[i];
-        
-        /*
-        if (val.type == PERL_REF)
+        if (this->dead_slots[i])
           {
-            if (val.val.ref)
-              {
-                if (val.val.ref->is_gc)
-                  {
-                    val.gc_state = GC_BLACK;
-                    val.val.ref->gc_state = GC_GRAY;
-                    this->grays.push_back (val.val.ref);
-                    ++ this->marked_roots;
-                  }
-              }
+            if (val.type == PERL_REF)
+              val.type = PERL_UNDEF;
+            continue;
           }
-        */
         
-        //if (false)
-        if ((val.type == PERL_REF) && val.val.ref && val.val.ref->is_gc)
+        if ((val.type == PERL_REF) && this->is_heap_ref (val.val.ref))
           {
-            val.gc_state = GC_BLACK;
-            val.val.ref->gc_state = GC_GRAY;
-            this->grays.push_back (val.val.ref);
+            this->paint_gray (val.val.ref);
             ++ this->marked_roots;
           }
       }
@@ -303,46 +746,89 @@ namespace arane {
     // 
     // Globals.
     // 
-    for (auto p : this->vm.globs)
+    for (auto& p : this->vm.globs)
       {
         p_value& val = p.second;
-        if ((val.type == PERL_REF) && val.val.ref && val.val.ref->is_gc)
-          {
-            val.gc_state = GC_BLACK;
-            val.val.ref->gc_state = GC_GRAY;
-            this->grays.push_back (val.val.ref);
-          }
+        if ((val.type == PERL_REF) && this->is_heap_ref (val.val.ref))
+          this->paint_gray (val.val.ref);
       }
+    
+    // 
+    // Temporaries.
+    // 
+    for (p_value *obj : this->temp_roots)
+      if (obj)
+        this->paint_gray (obj);
   }
   
   
   /* 
-   * Marks the children of the specified value.
+   * Marks the children of the specified gray object.
+   * Returns the amount of work done, in units of marked objects.
    */
-  void
-  garbage_collector::mark_children (p_value *val)
+  unsigned int
+  garbage_collector::mark_children (gc::mark_entry ent)
   {
+    p_value *val = ent.obj;
     switch (val->type)
       {
       case PERL_REF:
-        this->paint_gray (val->val.ref);
+        if (this->is_heap_ref (val->val.ref))
+          this->paint_gray (val->val.ref);
         break;
       
       case PERL_ARRAY:
         {
+          // arrays are scanned from the end towards the start, at most
+          // GC_ARRAY_SCAN_CHUNK elements at a time.  the cursor holds the
+          // position in the payload up to which elements are still left to
+          // scan.  shift and unshift do not move elements within the
+          // payload, and those that move otherwise only ever move towards
+          // its start (see rescan ()), so none can slip past the cursor in
+          // between steps.
           auto& data = val->val.arr;
-          for (unsigned int i = 0; i < data.len; ++i)
+          p_value *elems = data.data - val->off;
+          unsigned int start = val->off;
+          unsigned int end = start + data.len;
+          if (ent.cursor < end)
+            end = (ent.cursor < start) ? start : ent.cursor;
+          
+          if (end - start > GC_ARRAY_SCAN_CHUNK)
+            {
+              unsigned int next = end - GC_ARRAY_SCAN_CHUNK;
+              
+              // pushed before the children of this chunk so that they are
+              // processed first.
+              this->grays.push (val, next);
+              start = next;
+            }
+          
+          for (unsigned int i = end; i > start; --i)
             {
-              auto& v = data.data[i];
-              if ((v.type == PERL_REF) && v.val.ref && v.val.ref->is_gc)
+              auto& v = elems[i - 1];
+              if ((v.type == PERL_REF) && this->is_heap_ref (v.val.ref))
                 this->paint_gray (v.val.ref);
             }
+          
+          return 1 + (end - start) / GC_ELEMS_PER_UNIT;
         }
+      
+      case PERL_DSTR:
+        if (val->flags & PF_ROPE)
+          {
+            p_rope *node = (p_rope *)val->val.str.data;
+            if ((node->left.type == PERL_REF) && this->is_heap_ref (node->left.val.ref))
+              this->paint_gray (node->left.val.ref);
+            if ((node->right.type == PERL_REF) && this->is_heap_ref (node->right.val.ref))
+              this->paint_gray (node->right.val.ref);
+          }
         break;
       
       
       default: ;
       }
+    
+    return 1;
   }
   
   
@@ -353,17 +839,39 @@ namespace arane {
   bool
   garbage_collector::incremental_mark (unsigned int limit)
   {
-    unsigned int marked = 0;
+    // objects popped off the mark stack wait in a small queue for a few
+    // iterations before being scanned, giving the prefetch issued for
+    // each of them time to bring it into the cache.
+    gc::mark_entry queue[GC_PREFETCH_DISTANCE];
+    unsigned int head = 0, count = 0;
+    unsigned int work = 0;
     
-    while (!this->grays.empty () && (marked++ < limit))
+    while (work < limit)
       {
-        p_value *val = this->grays.back ();
-        this->grays.pop_back ();
+        if (!this->grays.empty ())
+          {
+            gc::mark_entry ent = this->grays.pop ();
+            __builtin_prefetch (ent.obj);
+            queue[(head + count++) & (GC_PREFETCH_DISTANCE - 1)] = ent;
+            if (count < GC_PREFETCH_DISTANCE)
+              continue;
+          }
+        else if (count == 0)
+          break;
         
-        this->mark_children (val);
+        gc::mark_entry ent = queue[head];
+        head = (head + 1) & (GC_PREFETCH_DISTANCE - 1);
+        -- count;
         
-        // blacken the object as all of its children have been marked.
-        val->gc_state = GC_BLACK;
+        work += this->mark_children (ent);
+      }
+    
+    // return objects that have not been scanned yet to the mark stack.
+    while (count > 0)
+      {
+        this->grays.push (queue[head]);
+        head = (head + 1) & (GC_PREFETCH_DISTANCE - 1);
+        -- count;
       }
     
     return !this->grays.empty ();
@@ -384,20 +892,23 @@ namespace arane {
   void
   garbage_collector::delete_object (p_value& val)
   {
+    if ((val.flags & PF_SHARED) && !this->release_shared ((val.type == PERL_ARRAY)
+      ? (void *)(val.val.arr.data - val.off) : val.val.str.data))
+      return;
+    
     switch (val.type)
       {
       case PERL_ARRAY:
-        delete[] val.val.arr.data;
-        this->ext_bytes -= val.val.arr.cap * sizeof (p_value);
+        this->free_payload (val.val.arr.data - val.off,
+          (val.off + val.val.arr.cap) * sizeof (p_value));
         break;
       
       case PERL_DSTR:
-        delete[] val.val.str.data;
-        this->ext_bytes -= val.val.str.cap;
+        this->free_payload (val.val.str.data, val.val.str.cap);
         break;
       
       case PERL_BIGINT:
-        mpz_clear (val.val.bint);
+        this->recycle_bint (val.val.bint);
         break;
       
       default: ;
@@ -406,27 +917,23 @@ namespace arane {
   
   
   /* 
-   * Destroys the page and all the objects inside it.
+   * Destroys all the objects inside the specified page.
    */
   void
   garbage_collector::free_page (gc::heap_page *page)
   {
-    const unsigned int aux_size = GC_PAGE_SIZE >> 6;
-    unsigned int bitmap_bytes = GC_PAGE_SIZE >> 3;
-    for (unsigned int i = 0; i < bitmap_bytes; ++i)
+    for (unsigned int w = 0; w < GC_BITMAP_WORDS; ++w)
       {
-        unsigned char bval = ~page->free_bitmap[aux_size + i];
-        while (bval) // check for used objects
+        unsigned long long used = ~page->free_bitmap[w];
+        while (used)
           {
-            unsigned int obj_index = (i << 3) | _find_lsb (bval);
-            bval &= ~(1 << (obj_index & 7));
+            unsigned int obj_index = (w << 6) | __builtin_ctzll (used);
+            used &= used - 1;
             
             p_value& val = page->objs[obj_index];
             this->delete_object (val);
           }
       }
-    
-    delete page;
   }
   
 
@@ -438,41 +945,42 @@ namespace arane {
   bool
   garbage_collector::sweep_page (gc::heap_page *page)
   {
-    bool dead_page = true;
+    unsigned int free_count = 0;
+    long long ext_before = this->ext_bytes;
+    long long freed = 0;
    
     GC_IF_DEBUG(std::cout << "    GC SWEEP PAGE" << std::endl;)
     
-    const unsigned int aux_size = GC_PAGE_SIZE >> 6;
-    unsigned int bitmap_bytes = GC_PAGE_SIZE >> 3;
-    for (unsigned int i = 0; i < bitmap_bytes; ++i)
+    for (unsigned int w = 0; w < GC_BITMAP_WORDS; ++w)
       {
-        unsigned char bval = ~page->free_bitmap[aux_size + i];
-        while (bval) // check for used objects
+        // used objects that have not been marked
+        unsigned long long dead = ~page->free_bitmap[w] & ~page->mark_bitmap[w];
+        for (unsigned long long bits = dead; bits; bits &= bits - 1)
           {
-            unsigned int obj_index = (i << 3) | _find_lsb (bval);
-            bval &= ~(1 << (obj_index & 7));
+            unsigned int obj_index = (w << 6) | __builtin_ctzll (bits);
             
-            GC_IF_DEBUG(std::cout << "      USED OBJECT @#" << obj_index << std::endl;)
-            p_value& val = page->objs[obj_index];
-            if ((val.gc_state == this->curr_white) && !val.gc_protect)
-              {
-                // dead object
-                
-                GC_IF_DEBUG(std::cout << "        DEAD" << std::endl;)
-                this->delete_object (val);
-                _mark_free (page, obj_index);
-              }
-            else
-              {
-                dead_page = false;
-                
-                // toggle type of white color for next cycle
-                val.gc_state = _opposite_white (this->curr_white);
-              }
+            GC_IF_DEBUG(std::cout << "      DEAD OBJECT @#" << obj_index << std::endl;)
+            this->delete_object (page->objs[obj_index]);
           }
+        
+        freed += __builtin_popcountll (dead);
+        page->free_bitmap[w] |= dead;
+        if (page->free_bitmap[w])
+          page->free_summary |= 1ULL << w;
+        
+        free_count += __builtin_popcountll (page->free_bitmap[w]);
       }
     
-    return dead_page;
+    this->obj_count -= freed;
+    this->cycle_objs_freed += freed;
+    this->cycle_bytes_freed += freed * sizeof (p_value)
+      + (ext_before - this->ext_bytes);
+    
+    unsigned int used = GC_PAGE_SIZE - free_count;
+    if (used && used * 100 < this->opts.compact * GC_PAGE_SIZE)
+      ++ this->sparse_pages;
+    
+    return free_count == GC_PAGE_SIZE;
   }
   
   /* 
@@ -485,6 +993,7 @@ namespace arane {
     auto page = this->to_sweep;
     while (page && (sweeped++ < limit))
       {
+        ++ this->swept_pages;
         if (this->sweep_page (page))
           {
             // page is now empty
@@ -492,7 +1001,7 @@ namespace arane {
             auto next = page->next;
             
             this->unlink_page (page);
-            delete page;
+            this->pool_page (page);
             
             page = next;
           }
@@ -501,110 +1010,1022 @@ namespace arane {
       }
     
     
+    this->to_sweep = page;
     return page != nullptr;
   }
   
 //------------------------------------------------------------------------------
   
+  
+  
   /* 
-   * Notifies the collector that the specified amount of bytes have been
-   * allocated outside of the GC (.e.g. dynamic strings, arrays, etc...).
+   * Compaction:
    */
-  void
-  garbage_collector::notify_increase (unsigned int count)
-  {
-    this->ext_bytes += count;
-    this->total_ext_bytes += count;
-    ++ this->inc_count;
-  }
+//------------------------------------------------------------------------------
   
   /* 
-   * Notifies the collector that the specified amount of bytes have been
-   * released outside of the GC (.e.g. from dynamic strings, arrays, etc...).
+   * Objects never move during regular collection, so a page that keeps a
+   * handful of survivors keeps its whole footprint.  Once a cycle leaves
+   * enough sparse pages behind, the VM calls compact() at the next back
+   * edge, which copies the objects out of these pages into other ones and
+   * then rewrites every reference to them.
+   * 
+   * This is "mostly-copying": objects referenced from the VM stack or from
+   * a root_scope may be reachable through pointers the collector does not
+   * see, so they are pinned and their page is only partially freed.
+   * 
+   * While pages are evacuated, the mark bits of an evacuating page select
+   * its pinned objects; every other used object in it has been moved, and
+   * its val.ref holds the forwarding address.
+   */
+  
+  /* 
+   * Marks the specified object as pinned if it lives in a page that is
+   * being evacuated.
    */
   void
-  garbage_collector::notify_decrease (unsigned int count)
+  garbage_collector::pin (p_value *ref)
   {
-    this->ext_bytes -= count;
+    if (!this->is_heap_ref (ref))
+      return;
+    
+    gc::heap_page *page = gc::page_of (ref);
+    if (page->evacuating)
+      _set_mark (page, ref - page->objs);
   }
   
-  
-  
-  
   /* 
-   * Performs a full garbage collection.
+   * Moves the object referenced by the specified value to its new location
+   * if it has been evacuated.
    */
-  void
-  garbage_collector::collect ()
+  inline void
+  garbage_collector::forward (p_value& val)
   {
-    // finish minor GC work
-    while (this->state != gc::GCS_NONE)
-      {
-        this->work ();
-      } 
-    
-    GC_IF_DEBUG(std::cout << "GC COLLECT" << std::endl;)
+    if ((val.type != PERL_REF) || !this->is_heap_ref (val.val.ref))
+      return;
     
-    // major GC
-    do
-      {
-        this->work ();
-      }
-    while (this->state != gc::GCS_NONE);
+    gc::heap_page *page = gc::page_of (val.val.ref);
+    int index = val.val.ref - page->objs;
+    if (page->evacuating && !_is_marked (page, index) && !_is_free (page, index))
+      val.val.ref = val.val.ref->val.ref;
   }
   
   /* 
-   * Performs one unit/cycle of work.
+   * Evacuates sparse pages.
    */
   void
-  garbage_collector::work ()
+  garbage_collector::compact ()
   {
-    switch (this->state)
+    this->compact_pending = false;
+    if (this->state != gc::GCS_NONE || this->in_arena || !this->opts.compact)
+      return;
+    
+    auto start = std::chrono::steady_clock::now ();
+    
+    // 
+    // Select the pages to evacuate.
+    // 
+    std::vector<gc::heap_page *> from;
+    for (auto page = this->pages; page; page = page->next)
       {
-      case gc::GCS_NONE:
-        GC_IF_DEBUG(std::cout << "  GC INC MARK START: [sp: " << this->vm.sp << "]" << std::endl;)
-        this->marked = 0;
-        this->marked_roots = 0;
-        this->mark_roots ();
-        this->state = gc::GCS_MARK;
+        unsigned int free_count = 0;
+        for (unsigned int w = 0; w < GC_BITMAP_WORDS; ++w)
+          free_count += __builtin_popcountll (page->free_bitmap[w]);
         
-        // flip current white color
-        this->curr_white = _opposite_white (this->curr_white);
-        break;
-      
-      case gc::GCS_MARK:
-        GC_IF_DEBUG(std::cout << "  GC INC MARK" << std::endl;)
-        if (!this->incremental_mark (GC_MARK_LIMIT))
-          {
-            // marking phase over
-            this->to_sweep = this->pages;
-            this->state = gc::GCS_SWEEP;
-            GC_IF_DEBUG(std::cout << "  GC INC SWEEP START [marked " << this->marked << ", " << this->marked_roots << " roots]" << std::endl;)
-          }
-        break;
-      
-      case gc::GCS_SWEEP:
-        GC_IF_DEBUG(std::cout << "  GC INC SWEEP" << std::endl;)
-        if (!this->incremental_sweep (GC_SWEEP_LIMIT))
-          {
-            // sweeping phase over
-            this->state = gc::GCS_NONE;
+        unsigned int used = GC_PAGE_SIZE - free_count;
+        if (used && used * 100 < this->opts.compact * GC_PAGE_SIZE)
+          from.push_back (page);
+      }
+    if (from.size () < GC_COMPACT_MIN_PAGES)
+      return;
+    
+    for (auto page : from)
+      {
+        page->evacuating = true;
+        for (unsigned int w = 0; w < GC_BITMAP_WORDS; ++w)
+          page->mark_bitmap[w] = 0;
+      }
+    
+    // 
+    // Pin objects referenced from the stack and temporary roots.
+    // 
+    for (int i = 0; i < this->vm.sp; ++i)
+      {
+        p_value& val = this->vm.stack[i];
+        if (val.type == PERL_REF)
+          this->pin (val.val.ref);
+      }
+    for (p_value *obj : this->temp_roots)
+      this->pin (obj);
+    
+    // 
+    // Evacuate.
+    // 
+    long long moved = 0;
+    gc::heap_page *dest = this->pages;
+    for (auto page : from)
+      for (unsigned int w = 0; w < GC_BITMAP_WORDS; ++w)
+        {
+          unsigned long long bits = ~page->free_bitmap[w] & ~page->mark_bitmap[w];
+          for (; bits; bits &= bits - 1)
+            {
+              p_value& src = page->objs[(w << 6) | __builtin_ctzll (bits)];
+              
+              while (dest && (dest->evacuating || !_page_space_available (dest)))
+                dest = dest->next;
+              if (!dest)
+                {
+                  dest = this->alloc_page ();
+                  this->link_page (dest);
+                }
+              
+              int index = _next_free_object_index (dest);
+              _mark_used (dest, index);
+              _set_mark (dest, index);
+              
+              p_value *nv = &dest->objs[index];
+              *nv = src;
+              src.val.ref = nv;
+              ++ moved;
+            }
+        }
+    
+    // 
+    // Update references.
+    // 
+    for (auto page = this->pages; page; page = page->next)
+      for (unsigned int w = 0; w < GC_BITMAP_WORDS; ++w)
+        {
+          unsigned long long bits = ~page->free_bitmap[w];
+          if (page->evacuating)
+            bits &= page->mark_bitmap[w];
+          for (; bits; bits &= bits - 1)
+            {
+              p_value& val = page->objs[(w << 6) | __builtin_ctzll (bits)];
+              if (val.type == PERL_REF)
+                this->forward (val);
+              else if (val.type == PERL_ARRAY)
+                {
+                  auto& data = val.val.arr;
+                  for (unsigned int i = 0; i < data.len; ++i)
+                    this->forward (data.data[i]);
+                }
+              else if (val.type == PERL_DSTR && (val.flags & PF_ROPE))
+                {
+                  p_rope *node = (p_rope *)val.val.str.data;
+                  this->forward (node->left);
+                  this->forward (node->right);
+                }
+            }
+        }
+    for (auto& p : this->vm.globs)
+      this->forward (p.second);
+    
+    // 
+    // Free the evacuated objects (without destroying them, their payloads
+    // now belong to the copies).
+    // 
+    long long freed_pages = 0;
+    for (auto page : from)
+      {
+        page->evacuating = false;
+        bool empty = true;
+        for (unsigned int w = 0; w < GC_BITMAP_WORDS; ++w)
+          {
+            page->free_bitmap[w] |= ~page->mark_bitmap[w];
+            if (page->free_bitmap[w])
+              page->free_summary |= 1ULL << w;
+            if (~page->free_bitmap[w])
+              empty = false;
+          }
+        
+        if (empty)
+          {
+            this->unlink_page (page);
+            this->pool_page (page);
+            ++ freed_pages;
           }
+      }
+    this->trim_pool ();
+    
+    ++ this->stats.compactions;
+    this->stats.objs_moved += moved;
+    this->stats.pages_compacted += freed_pages;
+    
+    auto end = std::chrono::steady_clock::now ();
+    this->record_pause (
+      std::chrono::duration_cast<std::chrono::nanoseconds> (end - start).count ());
+  }
+  
+//------------------------------------------------------------------------------
+  
+  /* 
+   * Notifies the collector that the specified amount of bytes have been
+   * allocated outside of the GC (.e.g. dynamic strings, arrays, etc...).
+   */
+  void
+  garbage_collector::notify_increase (unsigned int count)
+  {
+    this->ext_bytes += count;
+    this->total_ext_bytes += count;
+    ++ this->inc_count;
+    if (this->ext_bytes > this->stats.peak_ext_bytes)
+      this->stats.peak_ext_bytes = this->ext_bytes;
+  }
+  
+  /* 
+   * Notifies the collector that the specified amount of bytes have been
+   * released outside of the GC (.e.g. from dynamic strings, arrays, etc...).
+   */
+  void
+  garbage_collector::notify_decrease (unsigned int count)
+  {
+    this->ext_bytes -= count;
+  }
+  
+  
+  
+  /* 
+   * Allocates an external payload (array elements, string data, etc...)
+   * of at least the specified amount of bytes.  The size is updated to
+   * hold the actual capacity of the payload.
+   */
+  void*
+  garbage_collector::alloc_payload (unsigned int& size)
+  {
+    void *ptr = this->payloads.alloc (size);
+    this->notify_increase (size);
+    return ptr;
+  }
+  
+  /* 
+   * Resizes the specified payload, preserving its first "used" bytes.
+   * The new size is updated to hold the actual capacity of the payload.
+   */
+  void*
+  garbage_collector::resize_payload (void *ptr, unsigned int used,
+    unsigned int old_size, unsigned int& new_size)
+  {
+    void *nptr = this->payloads.resize (ptr, used, old_size, new_size);
+    if (new_size > old_size)
+      this->notify_increase (new_size - old_size);
+    else
+      this->notify_decrease (old_size - new_size);
+    return nptr;
+  }
+  
+  /* 
+   * Releases a payload of the specified capacity.
+   */
+  void
+  garbage_collector::free_payload (void *ptr, unsigned int size)
+  {
+    this->payloads.free (ptr, size);
+    this->notify_decrease (size);
+  }
+  
+  
+  p_value*
+  garbage_collector::alloc_array_data (unsigned int& cap)
+  {
+    unsigned int size = cap * sizeof (p_value);
+    p_value *data = (p_value *)this->alloc_payload (size);
+    cap = size / sizeof (p_value);
+    return data;
+  }
+  
+  p_value*
+  garbage_collector::resize_array_data (p_value *data, unsigned int len,
+    unsigned int old_cap, unsigned int& cap)
+  {
+    unsigned int size = cap * sizeof (p_value);
+    data = (p_value *)this->resize_payload (data, len * sizeof (p_value),
+      old_cap * sizeof (p_value), size);
+    cap = size / sizeof (p_value);
+    return data;
+  }
+  
+  char*
+  garbage_collector::alloc_string_data (unsigned int& cap)
+  {
+    return (char *)this->alloc_payload (cap);
+  }
+  
+  char*
+  garbage_collector::resize_string_data (char *data, unsigned int len,
+    unsigned int old_cap, unsigned int& cap)
+  {
+    return (char *)this->resize_payload (data, len, old_cap, cap);
+  }
+  
+  
+  
+  void
+  garbage_collector::share_payload (p_value *orig, p_value *copy)
+  {
+    void *payload = (orig->type == PERL_ARRAY)
+      ? (void *)(orig->val.arr.data - orig->off) : orig->val.str.data;
+    
+    // objects that are still flagged after all their copies have died
+    // are no longer in the table.
+    unsigned int& count = this->shared[payload];
+    count = count ? (count + 1) : 2;
+    
+    // an in-place append would be seen by the copy.
+    orig->flags = (orig->flags & ~PF_UNIQUE) | PF_SHARED;
+    copy->flags = PF_SHARED;
+  }
+  
+  bool
+  garbage_collector::release_shared (void *payload)
+  {
+    auto itr = this->shared.find (payload);
+    if (itr == this->shared.end ())
+      return true;
+    
+    if (-- itr->second == 1)
+      this->shared.erase (itr);
+    return false;
+  }
+  
+  void
+  garbage_collector::copy_shared (p_value *obj)
+  {
+    obj->flags &= ~PF_SHARED;
+    if (obj->type == PERL_ARRAY)
+      {
+        auto& arr = obj->val.arr;
+        if (this->release_shared (arr.data - obj->off))
+          return;
+        
+        unsigned int cap = arr.cap;
+        p_value *data = this->alloc_array_data (cap);
+        std::memcpy (data, arr.data, arr.len * sizeof (p_value));
+        arr.data = data;
+        arr.cap = cap;
+        obj->off = 0;
+      }
+    else
+      {
+        auto& str = obj->val.str;
+        if (this->release_shared (str.data))
+          return;
+        
+        unsigned int cap = str.len + 1;
+        char *data = this->alloc_string_data (cap);
+        std::memcpy (data, str.data, str.len + 1);
+        str.data = data;
+        str.cap = cap;
+      }
+  }
+  
+  void
+  garbage_collector::rescan (p_value *obj)
+  {
+    if (this->state != gc::GCS_MARK || !this->is_heap_ref (obj))
+      return;
+    
+    // unmarked arrays are scanned in full once reached.
+    gc::heap_page *page = gc::page_of (obj);
+    if (_is_marked (page, obj - page->objs))
+      this->grays.push (obj);
+  }
+  
+  void
+  garbage_collector::shade (const p_value& val)
+  {
+    // everything reachable when the cycle started gets marked this way,
+    // even if the only reference left to it is in a scanned object.
+    if (this->state == gc::GCS_MARK && val.type == PERL_REF
+      && this->is_heap_ref (val.val.ref))
+      this->paint_gray (val.val.ref);
+  }
+  
+  
+  
+  /* 
+   * Big integers:
+   */
+//------------------------------------------------------------------------------
+  
+  /* 
+   * GMP allocates limbs through a set of process-wide memory functions.
+   * While a collector exists they are pointed at its payload allocator:
+   * limbs then come from the same slabs as strings and arrays, and their
+   * size is added to the external bytes that drive the collector, so a
+   * loop that builds huge integers triggers collections like any other
+   * allocation-heavy loop.
+   * 
+   * GMP passes the size a block was requested with back when it resizes or
+   * frees it, and the slab allocator deduces the block's size class from
+   * that, so no sizes have to be tracked here.  The accounting uses the
+   * rounded sizes, which is what alloc_payload() reports.
+   * 
+   * Limbs must be resized and freed by the functions that allocated them.
+   * Integers initialized before hook_gmp() (with GMP's default functions)
+   * must not be resized or cleared while the hook is in place, and those
+   * allocated through it must not be resized or cleared after
+   * unhook_gmp(): the collector's slabs are gone by then.
+   */
+  
+  static garbage_collector *_gmp_owner = nullptr;
+  static void* (*_gmp_prev_alloc) (size_t);
+  static void* (*_gmp_prev_realloc) (void *, size_t, size_t);
+  static void (*_gmp_prev_free) (void *, size_t);
+  
+  /* 
+   * Returns the specified size as a payload capacity.  Payload sizes are
+   * unsigned ints that the slab allocator rounds up to a multiple of the
+   * page size, so anything that does not fit one with room to spare
+   * (4GB or more) is rejected rather than truncated.
+   */
+  static unsigned int
+  _gmp_size (size_t size)
+  {
+    if (size > UINT_MAX - SLAB_SIZE)
+      throw std::bad_alloc ();
+    return size;
+  }
+  
+  static void*
+  _gmp_alloc (size_t size)
+  {
+    unsigned int cap = _gmp_size (size);
+    return _gmp_owner->alloc_payload (cap);
+  }
+  
+  static void*
+  _gmp_realloc (void *ptr, size_t old_size, size_t new_size)
+  {
+    unsigned int cap = _gmp_size (new_size);
+    return _gmp_owner->resize_payload (ptr,
+      (old_size < new_size) ? old_size : new_size,
+      gc::slab_allocator::round_size (old_size), cap);
+  }
+  
+  static void
+  _gmp_free (void *ptr, size_t size)
+  {
+    _gmp_owner->free_payload (ptr, gc::slab_allocator::round_size (size));
+  }
+  
+  
+  /* 
+   * Routes GMP's memory allocation through the collector's payload
+   * allocator, so that growing integers count as external bytes.
+   */
+  void
+  garbage_collector::hook_gmp ()
+  {
+    // only one collector can own GMP's memory at a time; any others fall
+    // back to leaving integers unaccounted.
+    if (_gmp_owner)
+      return;
+    
+    _gmp_owner = this;
+    mp_get_memory_functions (&_gmp_prev_alloc, &_gmp_prev_realloc,
+      &_gmp_prev_free);
+    mp_set_memory_functions (_gmp_alloc, _gmp_realloc, _gmp_free);
+  }
+  
+  /* 
+   * Restores GMP's previous memory functions.
+   */
+  void
+  garbage_collector::unhook_gmp ()
+  {
+    if (_gmp_owner != this)
+      return;
+    
+    mp_set_memory_functions (_gmp_prev_alloc, _gmp_prev_realloc,
+      _gmp_prev_free);
+    _gmp_owner = nullptr;
+  }
+  
+  
+  /* 
+   * Initializes the specified integer to zero, reusing the limbs of a
+   * previously destroyed integer if possible.
+   */
+  void
+  garbage_collector::init_bint (mpz_t n)
+  {
+    if (this->bint_pool.empty ())
+      {
+        mpz_init (n);
+        return;
+      }
+    
+    *n = this->bint_pool.back ();
+    this->bint_pool.pop_back ();
+    mpz_set_ui (n, 0);
+  }
+  
+  /* 
+   * Puts the specified integer in the bigint pool, or clears it if the
+   * pool is full.
+   */
+  void
+  garbage_collector::recycle_bint (mpz_t n)
+  {
+    // integers belonging to another collector must go back to GMP.
+    if (_gmp_owner == this && this->bint_pool.size () < GC_BINT_POOL_SIZE
+      && n->_mp_alloc <= GC_BINT_POOL_LIMBS)
+      this->bint_pool.push_back (*n);
+    else
+      mpz_clear (n);
+  }
+  
+//------------------------------------------------------------------------------
+  
+  
+  
+  
+  /* 
+   * Pacing:
+   */
+//------------------------------------------------------------------------------
+  
+  /* 
+   * Returns the approximate size of the heap in bytes (objects and
+   * external payloads).
+   */
+  long long
+  garbage_collector::heap_size () const
+  {
+    return this->obj_count * sizeof (p_value) + this->ext_bytes;
+  }
+  
+  /* 
+   * Returns the heap size the pacer tries to keep the heap under
+   * (used by the GCP_HEAP pacer).
+   */
+  long long
+  garbage_collector::heap_goal () const
+  {
+    long long goal = this->live_bytes * (100 + this->opts.target_overhead) / 100;
+    return (goal < GC_MIN_HEAP_GOAL) ? GC_MIN_HEAP_GOAL : goal;
+  }
+  
+  /* 
+   * Checks whether a new collection cycle should be started.
+   */
+  bool
+  garbage_collector::should_start_cycle () const
+  {
+    if (this->opts.pacer != gc::GCP_HEAP)
+      return true;
+    
+    // start half way between the live heap and the goal, so that the
+    // cycle has the rest of the headroom to complete in.
+    long long goal = this->heap_goal ();
+    return this->heap_size () >= (this->live_bytes + (goal - this->live_bytes) / 2);
+  }
+  
+  /* 
+   * Computes the amount of work to do in the next step.
+   */
+  void
+  garbage_collector::pace ()
+  {
+    switch (this->opts.pacer)
+      {
+      case gc::GCP_FIXED:
+        this->mark_budget = this->opts.mark_limit;
+        this->sweep_budget = this->opts.sweep_limit;
+        break;
+      
+      case gc::GCP_HEAP:
+        {
+          long long heap = this->heap_size ();
+          long long rate = heap - this->last_heap_size; // since last step
+          this->last_heap_size = heap;
+          if (rate < 1)
+            rate = 1;
+          
+          long long steps_left = (this->heap_goal () - heap) / rate;
+          if (steps_left < 1)
+            steps_left = 1;
+          
+          // estimate remaining work in units of marked objects.
+          long long work = (long long)this->page_count * GC_SWEEP_PAGE_COST;
+          if (this->state == gc::GCS_SWEEP)
+            work -= (long long)this->swept_pages * GC_SWEEP_PAGE_COST;
+          else
+            {
+              long long to_mark = this->live_objs - this->marked;
+              if (to_mark < (long long)this->grays.size ())
+                to_mark = this->grays.size ();
+              work += to_mark;
+            }
+          
+          long long units = work / steps_left;
+          if (units < this->opts.mark_limit)
+            units = this->opts.mark_limit;
+          if (units > 0x7FFFFFFF)
+            units = 0x7FFFFFFF;
+          
+          this->mark_budget = units;
+          this->sweep_budget = units / GC_SWEEP_PAGE_COST;
+          if (this->sweep_budget < this->opts.sweep_limit)
+            this->sweep_budget = this->opts.sweep_limit;
+        }
+        break;
+      
+      case gc::GCP_PAUSE:
+        this->mark_budget = this->opts.mark_limit * this->pause_scale;
+        this->sweep_budget = this->opts.sweep_limit * this->pause_scale;
+        if (this->mark_budget < 16)
+          this->mark_budget = 16;
+        if (this->sweep_budget < 1)
+          this->sweep_budget = 1;
         break;
       }
   }
   
+  /* 
+   * Adjusts the step size according to how long the last step took
+   * (used by the GCP_PAUSE pacer).
+   */
+  void
+  garbage_collector::adjust_pause (long long usecs)
+  {
+    long long target = this->opts.target_pause;
+    if (usecs > target)
+      this->pause_scale *= 0.75;
+    else if (usecs < target / 2)
+      this->pause_scale *= 1.25;
+    
+    if (this->pause_scale < 1.0 / 64)
+      this->pause_scale = 1.0 / 64;
+    else if (this->pause_scale > 64.0)
+      this->pause_scale = 64.0;
+  }
+  
+//------------------------------------------------------------------------------
+  
+  
+  
+  /* 
+   * Performs a full garbage collection.
+   */
+  void
+  garbage_collector::collect ()
+  {
+    if (this->in_arena)
+      this->leave_arena ();
+    
+    auto start = std::chrono::steady_clock::now ();
+    unsigned int mark_budget = this->mark_budget;
+    unsigned int sweep_budget = this->sweep_budget;
+    this->mark_budget = this->sweep_budget = 0xFFFFFFFFU;
+    
+    // finish minor GC work
+    while (this->state != gc::GCS_NONE)
+      {
+        this->work ();
+      } 
+    
+    GC_IF_DEBUG(std::cout << "GC COLLECT" << std::endl;)
+    
+    // major GC
+    do
+      {
+        this->work ();
+      }
+    while (this->state != gc::GCS_NONE);
+    
+    this->mark_budget = mark_budget;
+    this->sweep_budget = sweep_budget;
+    
+    ++ this->stats.full_collections;
+    auto end = std::chrono::steady_clock::now ();
+    this->record_pause (
+      std::chrono::duration_cast<std::chrono::nanoseconds> (end - start).count ());
+  }
+  
+  /* 
+   * Performs one unit/cycle of work.
+   */
+  void
+  garbage_collector::work ()
+  {
+    auto start = std::chrono::steady_clock::now ();
+    gc::gc_state phase = this->state;
+    
+    switch (this->state)
+      {
+      case gc::GCS_NONE:
+        GC_IF_DEBUG(std::cout << "  GC INC MARK START: [sp: " << this->vm.sp << "]" << std::endl;)
+        this->marked = 0;
+        this->marked_roots = 0;
+        this->sparse_pages = 0;
+        this->clear_marks ();
+        this->mark_roots ();
+        this->state = gc::GCS_MARK;
+        break;
+      
+      case gc::GCS_MARK:
+        GC_IF_DEBUG(std::cout << "  GC INC MARK" << std::endl;)
+        if (!this->incremental_mark (this->mark_budget))
+          {
+            // marking phase over
+            this->live_objs = this->marked;
+            this->to_sweep = this->pages;
+            this->swept_pages = 0;
+            this->state = gc::GCS_SWEEP;
+            GC_IF_DEBUG(std::cout << "  GC INC SWEEP START [marked " << this->marked << ", " << this->marked_roots << " roots]" << std::endl;)
+          }
+        break;
+      
+      case gc::GCS_SWEEP:
+        GC_IF_DEBUG(std::cout << "  GC INC SWEEP" << std::endl;)
+        if (!this->incremental_sweep (this->sweep_budget))
+          {
+            // sweeping phase over
+            this->payloads.release_empty ();
+            this->trim_pool ();
+            this->live_bytes = this->last_heap_size = this->heap_size ();
+            this->compact_pending = this->opts.compact
+              && (this->sparse_pages >= GC_COMPACT_MIN_PAGES);
+            this->state = gc::GCS_NONE;
+          }
+        break;
+      }
+    
+    // 
+    // Telemetry.
+    // 
+    auto end = std::chrono::steady_clock::now ();
+    long long nsecs = std::chrono::duration_cast<std::chrono::nanoseconds> (
+      end - start).count ();
+    this->last_work_time = nsecs;
+    if (phase == gc::GCS_SWEEP)
+      {
+        this->stats.sweep_time += nsecs;
+        this->cycle_sweep_time += nsecs;
+        if (this->state == gc::GCS_NONE)
+          {
+            // cycle complete
+            ++ this->stats.cycles;
+            this->stats.last_mark_time = this->cycle_mark_time;
+            this->stats.last_sweep_time = this->cycle_sweep_time;
+            this->stats.live_objs = this->live_objs;
+            this->stats.objs_freed += this->cycle_objs_freed;
+            this->stats.bytes_freed += this->cycle_bytes_freed;
+            this->stats.last_objs_freed = this->cycle_objs_freed;
+            this->stats.last_bytes_freed = this->cycle_bytes_freed;
+            
+            this->cycle_mark_time = this->cycle_sweep_time = 0;
+            this->cycle_objs_freed = this->cycle_bytes_freed = 0;
+          }
+      }
+    else
+      {
+        this->stats.mark_time += nsecs;
+        this->cycle_mark_time += nsecs;
+      }
+  }
+  
+  
+  /* 
+   * Performs one incremental step and records its duration.
+   */
+  void
+  garbage_collector::step ()
+  {
+    this->pace ();
+    this->work ();
+    
+    this->record_pause (this->last_work_time);
+    if (this->opts.pacer == gc::GCP_PAUSE)
+      this->adjust_pause (this->last_work_time / 1000);
+  }
+  
+  /* 
+   * Adds a pause of the specified length (in nanoseconds) to the stats.
+   */
+  void
+  garbage_collector::record_pause (long long nsecs)
+  {
+    ++ this->stats.steps;
+    this->stats.total_pause += nsecs;
+    if (nsecs > this->stats.max_pause)
+      this->stats.max_pause = nsecs;
+    
+    unsigned long long usecs = nsecs / 1000;
+    int bucket = usecs ? (64 - __builtin_clzll (usecs)) : 0;
+    if (bucket >= GC_PAUSE_BUCKETS)
+      bucket = GC_PAUSE_BUCKETS - 1;
+    ++ this->stats.pause_hist[bucket];
+  }
+  
+  
+  /* 
+   * Returns a snapshot of the collector's statistics.
+   */
+  gc::gc_stats
+  garbage_collector::get_stats () const
+  {
+    gc::gc_stats st = this->stats;
+    st.objs_allocated = this->total_alloc_count;
+    st.objs = this->obj_count;
+    st.pages = this->page_count;
+    st.total_pages = this->total_page_count;
+    st.pooled_pages = this->pool.size ();
+    st.released_pages = this->released.size ();
+    st.mapped_bytes = (long long)this->chunks.size () * GC_CHUNK_BYTES;
+    st.payload_slabs = this->payloads.get_slab_count ();
+    st.large_objects = this->payloads.get_large_count ();
+    st.large_bytes = this->payloads.get_large_bytes ();
+    st.ext_bytes = this->ext_bytes;
+    st.total_ext_bytes = this->total_ext_bytes;
+    st.in_arena = this->in_arena;
+    st.run_time = std::chrono::duration_cast<std::chrono::nanoseconds> (
+      std::chrono::steady_clock::now () - this->start_time).count ();
+    return st;
+  }
+  
+  
+  
+  /* 
+   * Heap snapshots:
+   */
+//------------------------------------------------------------------------------
+  
+  /* 
+   * Performs a full collection and records the resulting object graph
+   * in the specified heap snapshot.
+   */
+  void
+  garbage_collector::take_snapshot (gc::heap_snapshot& snap)
+  {
+    this->collect ();
+    
+    // number objects in page order.
+    std::unordered_map<p_value *, unsigned int> ids;
+    std::vector<p_value *> objs;
+    for (auto page = this->pages; page; page = page->next)
+      for (unsigned int w = 0; w < GC_BITMAP_WORDS; ++w)
+        for (unsigned long long used = ~page->free_bitmap[w]; used;
+          used &= used - 1)
+          {
+            p_value *val = &page->objs[(w << 6) | __builtin_ctzll (used)];
+            ids[val] = objs.size ();
+            objs.push_back (val);
+          }
+    
+    auto add_ref = [&] (p_value& v) {
+      if ((v.type == PERL_REF) && this->is_heap_ref (v.val.ref))
+        snap.add_ref (ids[v.val.ref]);
+    };
+    
+    for (p_value *val : objs)
+      {
+        unsigned int payload = 0, len = 0;
+        switch (val->type)
+          {
+          case PERL_ARRAY:
+            payload = (val->off + val->val.arr.cap) * sizeof (p_value);
+            len = val->val.arr.len;
+            break;
+          
+          case PERL_DSTR:
+            payload = val->val.str.cap;
+            len = val->val.str.len;
+            break;
+          
+          case PERL_BIGINT:
+            payload = val->val.bint->_mp_alloc * sizeof (mp_limb_t);
+            break;
+          
+          default: ;
+          }
+        
+        snap.add_object (val->type, sizeof (p_value), payload, len);
+        if (val->type == PERL_REF)
+          add_ref (*val);
+        else if (val->type == PERL_ARRAY)
+          for (unsigned int i = 0; i < val->val.arr.len; ++i)
+            add_ref (val->val.arr.data[i]);
+        else if (val->type == PERL_DSTR && (val->flags & PF_ROPE))
+          {
+            p_rope *node = (p_rope *)val->val.str.data;
+            add_ref (node->left);
+            add_ref (node->right);
+          }
+      }
+    
+    // 
+    // Roots.
+    // 
+    this->vm.find_dead_locals (this->dead_slots);
+    for (int i = 0; i < this->vm.sp; ++i)
+      {
+        p_value& val = this->vm.stack[i];
+        if (this->dead_slots[i])
+          continue;
+        if ((val.type == PERL_REF) && this->is_heap_ref (val.val.ref))
+          snap.add_root ("stack[" + std::to_string (i) + "]", ids[val.val.ref]);
+      }
+    for (auto& p : this->vm.globs)
+      {
+        p_value& val = p.second;
+        if ((val.type == PERL_REF) && this->is_heap_ref (val.val.ref))
+          snap.add_root (p.first, ids[val.val.ref]);
+      }
+    for (size_t i = 0; i < this->temp_roots.size (); ++i)
+      if (this->temp_roots[i])
+        snap.add_root ("temp[" + std::to_string (i) + "]",
+          ids[this->temp_roots[i]]);
+  }
+  
+  /* 
+   * Writes a heap snapshot to the file at the specified path.
+   * Returns false if the file could not be written.
+   */
+  bool
+  garbage_collector::write_snapshot (const std::string& path)
+  {
+    gc::heap_snapshot snap;
+    this->take_snapshot (snap);
+    
+    std::ofstream fs { path, std::ios_base::out };
+    if (!fs)
+      return false;
+    snap.save (fs);
+    return (bool)fs;
+  }
+  
+  
+  static volatile std::sig_atomic_t _snapshot_requested = 0;
+  
+  /* 
+   * Asks the collector to write a heap snapshot to the configured path
+   * at its next step.  Safe to call from a signal handler.
+   */
+  void
+  garbage_collector::request_snapshot ()
+  {
+    _snapshot_requested = 1;
+  }
+  
+  /* 
+   * Writes a heap snapshot to the configured path if one was requested
+   * or if the heap has grown past the snapshot threshold.  If "at_exit"
+   * is true, a snapshot is written unless one had been written before.
+   */
+  void
+  garbage_collector::check_snapshot (bool at_exit)
+  {
+    if (this->opts.snapshot.empty ())
+      return;
+    
+    bool write = false;
+    if (_snapshot_requested)
+      {
+        _snapshot_requested = 0;
+        write = true;
+      }
+    else if (at_exit)
+      write = !this->snapshot_taken;
+    else if (this->opts.snapshot_at && !this->snapshot_taken
+      && this->heap_size () >= this->opts.snapshot_at)
+      write = true;
+    if (!write)
+      return;
+    
+    this->snapshot_taken = true;
+    if (!this->write_snapshot (this->opts.snapshot))
+      std::cerr << "arane: warning: could not write heap snapshot to `"
+                << this->opts.snapshot << "'" << std::endl;
+  }
+  
+//------------------------------------------------------------------------------
+  
   
   
   /* 
    * Allocates and returns a new object.
    */
   p_value*
-  garbage_collector::alloc (bool protect)
+  garbage_collector::alloc ()
   {
+    if (this->in_arena)
+      {
+        if (this->heap_size () < this->opts.arena_limit)
+          return this->arena_alloc ();
+        this->leave_arena ();
+      }
+    
     ++ this->alloc_count;
     ++ this->total_alloc_count;
-    long long ext_inc = this->ext_bytes - this->last_ext_bytes;
+    
+    // large payloads are left out of the external memory trigger, so that
+    // growing a single huge array does not keep forcing full collections;
+    // they are still part of the heap size used by the pacer.
+    long long ext_inc = this->ext_bytes - this->payloads.get_large_bytes ()
+      - this->last_ext_bytes;
     long long allocs_since = this->alloc_count - this->last_alloc_count;
     
     // 
@@ -613,24 +2034,31 @@ namespace arane {
     enum {
       NOTHING, CYCLE, FULL
     } act = NOTHING;
-    if ((ext_inc > 67108864) && (allocs_since > 32)) // 64MB
+    if (this->opts.ext_trigger && (ext_inc > this->opts.ext_trigger)
+      && (allocs_since > 32))
       {
         act = FULL;
       }
-    else if (this->alloc_count >= GC_ALLOC_THRESHOLD)
+    else if (this->alloc_count >= this->opts.alloc_threshold)
       {
         act = CYCLE;
       }
     if (act != NOTHING)
       {
         if (act == CYCLE)
-          this->work ();
+          {
+            if (this->state != gc::GCS_NONE || this->should_start_cycle ())
+              this->step ();
+          }
         else if (act == FULL)
           this->collect ();
+        
+        this->check_snapshot ();
           
         this->alloc_count = 0;
         this->last_alloc_count = this->alloc_count;
-        this->last_ext_bytes = this->ext_bytes;
+        this->last_ext_bytes = this->ext_bytes
+          - this->payloads.get_large_bytes ();
       }
     
     auto page = this->pages;
@@ -644,27 +2072,66 @@ namespace arane {
     unsigned int free_index = _next_free_object_index (page);
     GC_IF_DEBUG(std::cout << "GC ALLOC [" << free_index << "]" << std::endl;)
     p_value *val = &page->objs[free_index];
+    val->flags = 0;
+    val->hash = 0;
     _mark_used (page, free_index);
+    _set_mark (page, free_index);
+    ++ this->obj_count;
     
-    val->is_gc = true;
-    val->gc_state = _opposite_white (this->curr_white);
-    val->gc_protect = protect;
     return val;
   }
   
+  /* 
+   * Bump-allocates an object from the head page (arena mode).
+   */
   p_value*
-  garbage_collector::alloc_copy (p_value& other, bool protect)
+  garbage_collector::arena_alloc ()
   {
-    p_value *val = this->alloc (protect);
+    ++ this->total_alloc_count;
     
-    *val = other;
+    auto page = this->pages;
+    if (this->bump == GC_PAGE_SIZE)
+      {
+        page = this->alloc_page ();
+        this->link_page (page);
+        this->bump = 0;
+      }
     
-    // restore GC fields
-    val->is_gc = true;
-    val->gc_state = _opposite_white (this->curr_white);
-    val->gc_protect = protect;
+    p_value *val = &page->objs[this->bump++];
+    val->flags = 0;
+    val->hash = 0;
+    ++ this->obj_count;
     
     return val;
   }
+  
+  /* 
+   * Switches from arena mode to regular garbage-collected allocation.
+   */
+  void
+  garbage_collector::leave_arena ()
+  {
+    this->in_arena = false;
+    
+    // free the unused tail of the head page.
+    auto page = this->pages;
+    for (unsigned int i = this->bump; i < GC_PAGE_SIZE; ++i)
+      page->free_bitmap[i >> 6] |= 1ULL << (i & 63);
+    for (unsigned int w = 0; w < GC_BITMAP_WORDS; ++w)
+      if (page->free_bitmap[w])
+        page->free_summary |= 1ULL << w;
+    
+    this->alloc_count = 0;
+    this->last_ext_bytes = this->ext_bytes - this->payloads.get_large_bytes ();
+  }
+  
+  p_value*
+  garbage_collector::alloc_copy (p_value& other)
+  {
+    p_value *val = this->alloc ();
+    *val = other;
+    val->flags = 0;
+    return val;
+  }
 }
 
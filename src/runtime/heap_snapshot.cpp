@@ -0,0 +1,453 @@
+/*
+ * Arane - A Perl 6 interpreter.
+ * Copyright (C) 2014 Jacob Zhitomirsky
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "runtime/heap_snapshot.hpp"
+#include "runtime/value.hpp"
+#include <algorithm>
+
+
+namespace arane {
+  
+  namespace gc {
+    
+#define HEAP_SNAPSHOT_MAGIC     "arane-heap"
+#define HEAP_SNAPSHOT_VERSION   1
+    
+// marks objects that are not reachable from any root.
+#define NO_DOMINATOR    0xFFFFFFFFU
+    
+    
+    static const char*
+    _type_name (unsigned char type)
+    {
+      switch (type)
+        {
+        case PERL_UNDEF:      return "undef";
+        case PERL_REF:        return "ref";
+        case PERL_INT:        return "int";
+        case PERL_CSTR:       return "cstr";
+        case PERL_DSTR:       return "str";
+        case PERL_ARRAY:      return "array";
+        case PERL_BIGINT:     return "bigint";
+        case PERL_BOOL:       return "bool";
+        case PERL_ISTR:       return "istr";
+        case PERL_TYPE:       return "type";
+        case PERL_INTERNAL:   return "internal";
+        
+        default: return "?";
+        }
+    }
+    
+    
+    
+    heap_snapshot::heap_snapshot ()
+    {
+      this->analyzed = false;
+    }
+    
+    
+    
+    /* 
+     * Appends a new object to the snapshot and returns its index.
+     * References added afterwards are attributed to this object.
+     */
+    unsigned int
+    heap_snapshot::add_object (unsigned char type, unsigned int self_size,
+      unsigned int payload_size, unsigned int len)
+    {
+      snapshot_object obj;
+      obj.type = type;
+      obj.self_size = self_size;
+      obj.payload_size = payload_size;
+      obj.len = len;
+      obj.first_ref = this->refs.size ();
+      obj.ref_count = 0;
+      
+      this->objs.push_back (obj);
+      this->analyzed = false;
+      return this->objs.size () - 1;
+    }
+    
+    /* 
+     * Adds a reference from the last added object to the specified one.
+     */
+    void
+    heap_snapshot::add_ref (unsigned int obj)
+    {
+      this->refs.push_back (obj);
+      ++ this->objs.back ().ref_count;
+    }
+    
+    /* 
+     * Adds a root reference to the specified object.
+     */
+    void
+    heap_snapshot::add_root (const std::string& name, unsigned int obj)
+    {
+      this->roots.push_back ({ name, obj });
+      this->analyzed = false;
+    }
+    
+    
+    
+    /* 
+     * Writes the snapshot to the specified stream.
+     */
+    void
+    heap_snapshot::save (std::ostream& strm) const
+    {
+      strm << HEAP_SNAPSHOT_MAGIC << ' ' << HEAP_SNAPSHOT_VERSION << ' '
+           << this->objs.size () << ' ' << this->roots.size () << '\n';
+      
+      for (auto& obj : this->objs)
+        {
+          strm << (unsigned int)obj.type << ' ' << obj.self_size << ' '
+               << obj.payload_size << ' ' << obj.len << ' ' << obj.ref_count;
+          for (unsigned int i = 0; i < obj.ref_count; ++i)
+            strm << ' ' << this->refs[obj.first_ref + i];
+          strm << '\n';
+        }
+      
+      for (auto& root : this->roots)
+        strm << root.obj << ' ' << root.name << '\n';
+      
+      strm.flush ();
+    }
+    
+    /* 
+     * Reads a snapshot from the specified stream.
+     * Returns false if the stream does not hold a valid snapshot.
+     */
+    bool
+    heap_snapshot::load (std::istream& strm)
+    {
+      this->objs.clear ();
+      this->refs.clear ();
+      this->roots.clear ();
+      this->analyzed = false;
+      
+      std::string magic;
+      unsigned int version, obj_count, root_count;
+      if (!(strm >> magic >> version >> obj_count >> root_count)
+        || magic != HEAP_SNAPSHOT_MAGIC || version != HEAP_SNAPSHOT_VERSION)
+        return false;
+      
+      this->objs.reserve (obj_count);
+      for (unsigned int i = 0; i < obj_count; ++i)
+        {
+          unsigned int type, self_size, payload_size, len, ref_count;
+          if (!(strm >> type >> self_size >> payload_size >> len >> ref_count))
+            return false;
+          
+          this->add_object (type, self_size, payload_size, len);
+          for (unsigned int j = 0; j < ref_count; ++j)
+            {
+              unsigned int ref;
+              if (!(strm >> ref) || ref >= obj_count)
+                return false;
+              this->add_ref (ref);
+            }
+        }
+      
+      for (unsigned int i = 0; i < root_count; ++i)
+        {
+          unsigned int obj;
+          std::string name;
+          if (!(strm >> obj) || obj >= obj_count)
+            return false;
+          strm >> std::ws;
+          std::getline (strm, name);
+          this->add_root (name, obj);
+        }
+      
+      return true;
+    }
+    
+    
+    
+    /* 
+     * Computes the dominator tree of the object graph and the retained
+     * size of every object (the amount of memory that would be freed if
+     * the object became unreachable).
+     * 
+     * Uses the iterative algorithm described by Cooper, Harvey and Kennedy
+     * in "A Simple, Fast Dominance Algorithm", with a virtual node (index N)
+     * that references all roots.
+     */
+    void
+    heap_snapshot::analyze ()
+    {
+      unsigned int n = this->objs.size ();
+      unsigned int vroot = n;
+      
+      auto succ_count = [&] (unsigned int v) -> unsigned int {
+        return (v == vroot) ? this->roots.size () : this->objs[v].ref_count;
+      };
+      auto succ = [&] (unsigned int v, unsigned int i) -> unsigned int {
+        return (v == vroot) ? this->roots[i].obj
+                            : this->refs[this->objs[v].first_ref + i];
+      };
+      
+      // 
+      // Number nodes in postorder (iterative depth-first search).
+      // 
+      std::vector<unsigned int> post (n + 1, NO_DOMINATOR);
+      std::vector<unsigned int> order;  // nodes in postorder
+      std::vector<bool> seen (n + 1, false);
+      std::vector<std::pair<unsigned int, unsigned int>> dfs;
+      order.reserve (n + 1);
+      
+      seen[vroot] = true;
+      dfs.push_back ({ vroot, 0 });
+      while (!dfs.empty ())
+        {
+          auto& top = dfs.back ();
+          unsigned int v = top.first;
+          if (top.second < succ_count (v))
+            {
+              unsigned int w = succ (v, top.second++);
+              if (!seen[w])
+                {
+                  seen[w] = true;
+                  dfs.push_back ({ w, 0 });
+                }
+            }
+          else
+            {
+              post[v] = order.size ();
+              order.push_back (v);
+              dfs.pop_back ();
+            }
+        }
+      
+      // 
+      // Predecessor lists of reachable nodes.
+      // 
+      std::vector<unsigned int> pred_start (n + 2, 0);
+      for (unsigned int v : order)
+        for (unsigned int i = 0; i < succ_count (v); ++i)
+          ++ pred_start[succ (v, i) + 1];
+      for (unsigned int i = 1; i < n + 2; ++i)
+        pred_start[i] += pred_start[i - 1];
+      
+      std::vector<unsigned int> preds (pred_start[n + 1]);
+      {
+        std::vector<unsigned int> fill (pred_start.begin (), pred_start.end () - 1);
+        for (unsigned int v : order)
+          for (unsigned int i = 0; i < succ_count (v); ++i)
+            preds[fill[succ (v, i)]++] = v;
+      }
+      
+      // 
+      // Immediate dominators.
+      // 
+      std::vector<unsigned int>& idom = this->idom;
+      idom.assign (n + 1, NO_DOMINATOR);
+      idom[vroot] = vroot;
+      
+      auto intersect = [&] (unsigned int a, unsigned int b) -> unsigned int {
+        while (a != b)
+          {
+            while (post[a] < post[b])
+              a = idom[a];
+            while (post[b] < post[a])
+              b = idom[b];
+          }
+        return a;
+      };
+      
+      bool changed = true;
+      while (changed)
+        {
+          changed = false;
+          
+          // reverse postorder, skipping the virtual root.
+          for (int i = (int)order.size () - 2; i >= 0; --i)
+            {
+              unsigned int v = order[i];
+              unsigned int new_idom = NO_DOMINATOR;
+              for (unsigned int j = pred_start[v]; j < pred_start[v + 1]; ++j)
+                {
+                  unsigned int p = preds[j];
+                  if (idom[p] == NO_DOMINATOR)
+                    continue;
+                  new_idom = (new_idom == NO_DOMINATOR) ? p
+                    : intersect (p, new_idom);
+                }
+              
+              if (idom[v] != new_idom)
+                {
+                  idom[v] = new_idom;
+                  changed = true;
+                }
+            }
+        }
+      
+      // 
+      // Retained sizes: every object's size is added to all of its
+      // dominators.  Dominators come after the nodes they dominate in
+      // postorder.
+      // 
+      this->retained.assign (n + 1, -1);
+      for (unsigned int v : order)
+        this->retained[v] = (v == vroot) ? 0
+          : ((long long)this->objs[v].self_size + this->objs[v].payload_size);
+      for (unsigned int v : order)
+        if (v != vroot)
+          this->retained[idom[v]] += this->retained[v];
+      
+      this->analyzed = true;
+    }
+    
+    /* 
+     * Returns the retained size of the specified object, or -1 if the
+     * object is not reachable from any root.
+     */
+    long long
+    heap_snapshot::get_retained_size (unsigned int obj) const
+    {
+      if (!this->analyzed || obj >= this->objs.size ())
+        return -1;
+      return this->retained[obj];
+    }
+    
+    
+    
+    /* 
+     * Prints an object census by type along with the roots and objects
+     * that retain the most memory.
+     */
+    void
+    heap_snapshot::print_report (std::ostream& strm, unsigned int top)
+    {
+      if (!this->analyzed)
+        this->analyze ();
+      
+      struct census_entry
+      {
+        long long count, self, payload;
+      } census[256] = { };
+      
+      long long total = 0, reachable = 0;
+      for (unsigned int i = 0; i < this->objs.size (); ++i)
+        {
+          auto& obj = this->objs[i];
+          auto& ent = census[obj.type];
+          ++ ent.count;
+          ent.self += obj.self_size;
+          ent.payload += obj.payload_size;
+          
+          long long size = (long long)obj.self_size + obj.payload_size;
+          total += size;
+          if (this->retained[i] != -1)
+            reachable += size;
+        }
+      
+      auto col = [&strm] (int width, const std::string& str) {
+        strm.width (width);
+        strm << str;
+      };
+      
+      strm << "heap snapshot: " << this->objs.size () << " objects, "
+           << this->roots.size () << " roots, " << total << " bytes ("
+           << reachable << " reachable, " << (total - reachable)
+           << " unreachable)" << std::endl;
+      
+      // 
+      // Census.
+      // 
+      strm << std::endl << "objects by type:" << std::endl;
+      col (12, "type"); col (12, "count"); col (14, "self");
+      col (14, "payload"); col (14, "total");
+      strm << std::endl;
+      for (int t = 0; t < 256; ++t)
+        {
+          auto& ent = census[t];
+          if (ent.count == 0)
+            continue;
+          
+          col (12, _type_name (t));
+          col (12, std::to_string (ent.count));
+          col (14, std::to_string (ent.self));
+          col (14, std::to_string (ent.payload));
+          col (14, std::to_string (ent.self + ent.payload));
+          strm << std::endl;
+        }
+      
+      // 
+      // Roots.
+      // 
+      std::vector<unsigned int> sorted;
+      for (unsigned int i = 0; i < this->roots.size (); ++i)
+        sorted.push_back (i);
+      std::stable_sort (sorted.begin (), sorted.end (),
+        [this] (unsigned int a, unsigned int b) {
+          return this->retained[this->roots[a].obj]
+            > this->retained[this->roots[b].obj];
+        });
+      if (sorted.size () > top)
+        sorted.resize (top);
+      
+      strm << std::endl << "roots by retained size:" << std::endl;
+      col (20, "root"); col (12, "object"); col (10, "type");
+      col (14, "retained");
+      strm << std::endl;
+      for (unsigned int i : sorted)
+        {
+          auto& root = this->roots[i];
+          col (20, root.name);
+          col (12, "#" + std::to_string (root.obj));
+          col (10, _type_name (this->objs[root.obj].type));
+          col (14, std::to_string (this->retained[root.obj]));
+          strm << std::endl;
+        }
+      
+      // 
+      // Objects.
+      // 
+      sorted.clear ();
+      for (unsigned int i = 0; i < this->objs.size (); ++i)
+        if (this->retained[i] != -1)
+          sorted.push_back (i);
+      std::stable_sort (sorted.begin (), sorted.end (),
+        [this] (unsigned int a, unsigned int b) {
+          return this->retained[a] > this->retained[b];
+        });
+      if (sorted.size () > top)
+        sorted.resize (top);
+      
+      strm << std::endl << "objects by retained size:" << std::endl;
+      col (12, "object"); col (10, "type"); col (10, "length");
+      col (14, "size"); col (14, "retained"); col (12, "dominator");
+      strm << std::endl;
+      for (unsigned int i : sorted)
+        {
+          auto& obj = this->objs[i];
+          col (12, "#" + std::to_string (i));
+          col (10, _type_name (obj.type));
+          col (10, std::to_string (obj.len));
+          col (14, std::to_string ((long long)obj.self_size + obj.payload_size));
+          col (14, std::to_string (this->retained[i]));
+          col (12, (this->idom[i] == this->objs.size ()) ? std::string ("<root>")
+            : ("#" + std::to_string (this->idom[i])));
+          strm << std::endl;
+        }
+    }
+  }
+}
+
@@ -0,0 +1,89 @@
+/*
+ * Arane - A Perl 6 interpreter.
+ * Copyright (C) 2014 Jacob Zhitomirsky
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "runtime/mark_stack.hpp"
+
+
+namespace arane {
+  
+  namespace gc {
+    
+    mark_stack::mark_stack ()
+    {
+      this->top = new mark_chunk;
+      this->top->prev = nullptr;
+      this->top->count = 0;
+      this->spare = nullptr;
+      this->chunk_count = 1;
+    }
+    
+    mark_stack::~mark_stack ()
+    {
+      this->clear ();
+      delete this->top;
+      delete this->spare;
+    }
+    
+    
+    
+    void
+    mark_stack::grow ()
+    {
+      mark_chunk *chunk = this->spare;
+      if (chunk)
+        this->spare = nullptr;
+      else
+        chunk = new mark_chunk;
+      
+      chunk->prev = this->top;
+      chunk->count = 0;
+      this->top = chunk;
+      ++ this->chunk_count;
+    }
+    
+    void
+    mark_stack::shrink ()
+    {
+      mark_chunk *chunk = this->top;
+      this->top = chunk->prev;
+      -- this->chunk_count;
+      
+      delete this->spare;
+      this->spare = chunk;
+    }
+    
+    
+    
+    /* 
+     * Removes all entries and releases all chunks but one.
+     */
+    void
+    mark_stack::clear ()
+    {
+      while (this->top->prev)
+        {
+          mark_chunk *prev = this->top->prev;
+          delete this->top;
+          this->top = prev;
+        }
+      this->top->count = 0;
+      this->chunk_count = 1;
+    }
+  }
+}
+
@@ -0,0 +1,163 @@
+/*
+ * Arane - A Perl 6 interpreter.
+ * Copyright (C) 2014 Jacob Zhitomirsky
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "runtime/numconv.hpp"
+#include <string>
+
+
+namespace arane {
+  
+  namespace numconv {
+    
+    static inline bool
+    _is_space (char c)
+    {
+      return c == ' ' || (c >= '\t' && c <= '\r');
+    }
+    
+    /* 
+     * Skips leading whitespace and the sign.  Returns the position of the
+     * first digit.
+     */
+    static unsigned int
+    _skip_prefix (const char *str, unsigned int len, bool& neg)
+    {
+      unsigned int i = 0;
+      while (i < len && _is_space (str[i]))
+        ++ i;
+      
+      neg = false;
+      if (i < len && (str[i] == '-' || str[i] == '+'))
+        neg = (str[i++] == '-');
+      return i;
+    }
+    
+    
+    parse_status
+    parse_int (const char *str, unsigned int len, long long& res)
+    {
+      bool neg;
+      unsigned int i = _skip_prefix (str, len, neg);
+      if (i == len || (unsigned char)(str[i] - '0') > 9)
+        {
+          res = 0;
+          return PARSE_NONE;
+        }
+      
+      // accumulated as a negative number, which has the larger range.
+      const long long lim = neg ? (-0x7FFFFFFFFFFFFFFFLL - 1) : -0x7FFFFFFFFFFFFFFFLL;
+      long long n = 0;
+      for (; i < len; ++i)
+        {
+          unsigned int d = (unsigned char)(str[i] - '0');
+          if (d > 9)
+            break;
+          
+          if (n < (lim + (long long)d) / 10)
+            {
+              res = neg ? lim : -lim;
+              return PARSE_OVERFLOW;
+            }
+          n = n * 10 - d;
+        }
+      
+      res = neg ? n : -n;
+      return PARSE_OK;
+    }
+    
+    void
+    parse_bint (const char *str, unsigned int len, mpz_ptr res)
+    {
+      bool neg;
+      unsigned int i = _skip_prefix (str, len, neg);
+      unsigned int start = i;
+      while (i < len && (unsigned char)(str[i] - '0') <= 9)
+        ++ i;
+      if (i == start)
+        {
+          mpz_set_ui (res, 0);
+          return;
+        }
+      
+      std::string digits (str + start, i - start);
+      mpz_set_str (res, digits.c_str (), 10);
+      if (neg)
+        mpz_neg (res, res);
+    }
+    
+    
+    
+    static const char _digit_pairs[] =
+      "00010203040506070809"
+      "10111213141516171819"
+      "20212223242526272829"
+      "30313233343536373839"
+      "40414243444546474849"
+      "50515253545556575859"
+      "60616263646566676869"
+      "70717273747576777879"
+      "80818283848586878889"
+      "90919293949596979899";
+    
+    static inline unsigned int
+    _count_digits (unsigned long long n)
+    {
+      unsigned int count = 1;
+      for (;;)
+        {
+          if (n < 10) return count;
+          if (n < 100) return count + 1;
+          if (n < 1000) return count + 2;
+          if (n < 10000) return count + 3;
+          n /= 10000;
+          count += 4;
+        }
+    }
+    
+    unsigned int
+    format_int (long long n, char *buf)
+    {
+      // the magnitude is computed as unsigned to handle the most negative value.
+      unsigned long long u = (n < 0) ? -(unsigned long long)n : n;
+      unsigned int len = _count_digits (u) + (n < 0);
+      if (n < 0)
+        buf[0] = '-';
+      
+      // two digits at a time, from the end.
+      char *p = buf + len;
+      while (u >= 100)
+        {
+          const char *pair = _digit_pairs + (u % 100) * 2;
+          u /= 100;
+          *--p = pair[1];
+          *--p = pair[0];
+        }
+      if (u >= 10)
+        {
+          const char *pair = _digit_pairs + u * 2;
+          *--p = pair[1];
+          *--p = pair[0];
+        }
+      else
+        *--p = '0' + u;
+      
+      return len;
+    }
+  }
+}
+
@@ -0,0 +1,139 @@
+/*
+ * Arane - A Perl 6 interpreter.
+ * Copyright (C) 2014 Jacob Zhitomirsky
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "runtime/output.hpp"
+#include "runtime/numconv.hpp"
+#include <iostream>
+#include <cstring>
+#include <cstdio>
+#include <unistd.h>
+
+
+namespace arane {
+  
+  output_writer::output_writer (std::ostream *strm)
+  {
+    this->strm = nullptr;
+    this->buf = new char [OUTPUT_BUFFER_SIZE];
+    this->pos = 0;
+    this->set_stream (strm);
+  }
+  
+  output_writer::~output_writer ()
+  {
+    this->flush ();
+    delete[] this->buf;
+  }
+  
+  
+  
+  void
+  output_writer::set_stream (std::ostream *strm)
+  {
+    this->flush ();
+    this->strm = strm;
+    
+    // someone may be watching the program run.
+    this->line_buffered = (strm == &std::cout) && isatty (fileno (stdout));
+  }
+  
+  
+  
+  void
+  output_writer::write (const char *data, unsigned int len)
+  {
+    if (len > OUTPUT_BUFFER_SIZE - this->pos)
+      {
+        this->flush ();
+        
+        // too large to be worth buffering
+        if (len >= OUTPUT_BUFFER_SIZE)
+          {
+            if (this->strm)
+              this->strm->write (data, len);
+            return;
+          }
+      }
+    
+    std::memcpy (this->buf + this->pos, data, len);
+    this->pos += len;
+  }
+  
+  void
+  output_writer::write_int (long long n)
+  {
+    if (OUTPUT_BUFFER_SIZE - this->pos < INT_STR_SIZE)
+      this->flush ();
+    this->pos += numconv::format_int (n, this->buf + this->pos);
+  }
+  
+  void
+  output_writer::write_bint (mpz_srcptr n)
+  {
+    // may be one more than the actual number of digits, plus a sign and
+    // the terminating null character.
+    size_t size = mpz_sizeinbase (n, 10) + 2;
+    if (size > OUTPUT_BUFFER_SIZE - this->pos)
+      {
+        this->flush ();
+        if (size > OUTPUT_BUFFER_SIZE)
+          {
+            // the string is allocated with GMP's memory functions.
+            void (*free_func) (void *, size_t);
+            mp_get_memory_functions (nullptr, nullptr, &free_func);
+            
+            char *s = mpz_get_str (nullptr, 10, n);
+            size_t len = std::strlen (s);
+            if (this->strm)
+              this->strm->write (s, len);
+            free_func (s, len + 1);
+            return;
+          }
+      }
+    
+    mpz_get_str (this->buf + this->pos, 10, n);
+    this->pos += std::strlen (this->buf + this->pos);
+  }
+  
+  
+  
+  void
+  output_writer::end_line ()
+  {
+    this->put ('\n');
+    this->sync ();
+  }
+  
+  void
+  output_writer::flush ()
+  {
+    if (!this->strm)
+      {
+        this->pos = 0;
+        return;
+      }
+    
+    if (this->pos > 0)
+      {
+        this->strm->write (this->buf, this->pos);
+        this->pos = 0;
+      }
+    this->strm->flush ();
+  }
+}
+
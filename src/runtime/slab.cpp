@@ -0,0 +1,344 @@
+/*
+ * Arane - A Perl 6 interpreter.
+ * Copyright (C) 2014 Jacob Zhitomirsky
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "runtime/slab.hpp"
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+namespace arane {
+  
+  namespace gc {
+    
+// offset of the first block in a slab (leaves room for the header).
+#define SLAB_HEADER_SIZE    64
+    
+    static_assert (sizeof (slab) <= SLAB_HEADER_SIZE,
+      "slab header does not fit in SLAB_HEADER_SIZE");
+    
+    
+    // returns the size class index of the specified payload size.
+    static inline unsigned int
+    _size_class (unsigned int size)
+    {
+      if (size <= SLAB_MIN_CLASS)
+        return 0;
+      return (32 - __builtin_clz (size - 1)) - 4;  // ceil(log2(size)) - 4
+    }
+    
+    static inline unsigned int
+    _class_size (unsigned int cls)
+    {
+      return SLAB_MIN_CLASS << cls;
+    }
+    
+    static inline slab*
+    _slab_of (void *ptr)
+    {
+      return (slab *)((unsigned long)ptr & ~((unsigned long)SLAB_SIZE - 1));
+    }
+    
+    static inline bool
+    _is_large (unsigned int size)
+    {
+      return size > LARGE_PAYLOAD_SIZE;
+    }
+    
+    // rounds the specified size up to a multiple of the system's page size.
+    static inline unsigned int
+    _page_round (unsigned int size)
+    {
+      static const unsigned int page_size = sysconf (_SC_PAGESIZE);
+      return (size + page_size - 1) & ~(page_size - 1);
+    }
+    
+    
+    
+    slab_allocator::slab_allocator ()
+    {
+      for (unsigned int i = 0; i < SLAB_CLASS_COUNT; ++i)
+        this->partial[i] = nullptr;
+      this->large_count = 0;
+      this->large_bytes = 0;
+    }
+    
+    slab_allocator::~slab_allocator ()
+    {
+      for (slab *s : this->slabs)
+        std::free (s);
+    }
+    
+    
+    
+    void*
+    slab_allocator::alloc_large (unsigned int& size)
+    {
+      size = _page_round (size);
+      void *ptr = mmap (nullptr, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (ptr == MAP_FAILED)
+        throw std::bad_alloc ();
+      
+      ++ this->large_count;
+      this->large_bytes += size;
+      return ptr;
+    }
+    
+    void*
+    slab_allocator::resize_large (void *ptr, unsigned int used,
+      unsigned int old_size, unsigned int& new_size)
+    {
+      new_size = _page_round (new_size);
+      
+#ifdef MREMAP_MAYMOVE
+      void *nptr = mremap (ptr, old_size, new_size, MREMAP_MAYMOVE);
+      if (nptr == MAP_FAILED)
+        throw std::bad_alloc ();
+#else
+      unsigned int size = new_size;
+      void *nptr = this->alloc_large (size);
+      std::memcpy (nptr, ptr, (used < new_size) ? used : new_size);
+      this->free_large (ptr, old_size);
+#endif
+      
+      this->large_bytes += (long long)new_size - _page_round (old_size);
+      return nptr;
+    }
+    
+    void
+    slab_allocator::free_large (void *ptr, unsigned int size)
+    {
+      size = _page_round (size);
+      munmap (ptr, size);
+      
+      -- this->large_count;
+      this->large_bytes -= size;
+    }
+    
+    
+    
+    slab*
+    slab_allocator::alloc_slab (unsigned int cls)
+    {
+      void *mem;
+      if (posix_memalign (&mem, SLAB_SIZE, SLAB_SIZE) != 0)
+        throw std::bad_alloc ();
+      
+      slab *s = (slab *)mem;
+      s->prev = s->next = nullptr;
+      s->free_list = nullptr;
+      s->bump = SLAB_HEADER_SIZE;
+      s->used = 0;
+      s->cls = cls;
+      s->partial = false;
+      
+      this->slabs.push_back (s);
+      return s;
+    }
+    
+    void
+    slab_allocator::link_partial (slab *s)
+    {
+      slab *& head = this->partial[s->cls];
+      s->prev = nullptr;
+      s->next = head;
+      if (head)
+        head->prev = s;
+      head = s;
+      s->partial = true;
+    }
+    
+    void
+    slab_allocator::unlink_partial (slab *s)
+    {
+      if (s->prev)
+        s->prev->next = s->next;
+      if (s->next)
+        s->next->prev = s->prev;
+      if (this->partial[s->cls] == s)
+        this->partial[s->cls] = s->next;
+      s->prev = s->next = nullptr;
+      s->partial = false;
+    }
+    
+    
+    
+    /* 
+     * Returns the amount of bytes actually reserved for a payload of the
+     * specified size.
+     */
+    unsigned int
+    slab_allocator::round_size (unsigned int size)
+    {
+      if (_is_large (size))
+        return _page_round (size);
+      if (size > SLAB_MAX_CLASS)
+        return size;
+      return _class_size (_size_class (size));
+    }
+    
+    /* 
+     * Allocates a payload of at least the specified amount of bytes.
+     * The size is updated to hold the actual capacity of the payload.
+     */
+    void*
+    slab_allocator::alloc (unsigned int& size)
+    {
+      if (_is_large (size))
+        return this->alloc_large (size);
+      if (size > SLAB_MAX_CLASS)
+        {
+          void *ptr = std::malloc (size);
+          if (!ptr)
+            throw std::bad_alloc ();
+          return ptr;
+        }
+      
+      unsigned int cls = _size_class (size);
+      unsigned int csize = _class_size (cls);
+      size = csize;
+      
+      slab *s = this->partial[cls];
+      if (!s)
+        {
+          s = this->alloc_slab (cls);
+          this->link_partial (s);
+        }
+      
+      void *ptr;
+      if (s->free_list)
+        {
+          ptr = s->free_list;
+          s->free_list = *(void **)ptr;
+        }
+      else
+        {
+          ptr = (unsigned char *)s + s->bump;
+          s->bump += csize;
+        }
+      
+      ++ s->used;
+      if (!s->free_list && (s->bump + csize > SLAB_SIZE))
+        this->unlink_partial (s); // slab is now full
+      
+      return ptr;
+    }
+    
+    /* 
+     * Releases a payload of the specified capacity.
+     */
+    void
+    slab_allocator::free (void *ptr, unsigned int size)
+    {
+      if (!ptr)
+        return;
+      if (_is_large (size))
+        {
+          this->free_large (ptr, size);
+          return;
+        }
+      if (size > SLAB_MAX_CLASS)
+        {
+          std::free (ptr);
+          return;
+        }
+      
+      slab *s = _slab_of (ptr);
+      *(void **)ptr = s->free_list;
+      s->free_list = ptr;
+      -- s->used;
+      
+      if (!s->partial)
+        this->link_partial (s);
+    }
+    
+    /* 
+     * Resizes the specified payload, preserving its first "used" bytes.
+     * Growth within the payload's size class happens in place.
+     * The new size is updated to hold the actual capacity of the payload.
+     */
+    void*
+    slab_allocator::resize (void *ptr, unsigned int used, unsigned int old_size,
+      unsigned int& new_size)
+    {
+      if (!ptr)
+        return this->alloc (new_size);
+      
+      if (_is_large (old_size) && _is_large (new_size))
+        return this->resize_large (ptr, used, old_size, new_size);
+      
+      if (old_size > SLAB_MAX_CLASS && new_size > SLAB_MAX_CLASS
+        && !_is_large (old_size) && !_is_large (new_size))
+        {
+          // both sizes are outside of the slabs' range.
+          void *nptr = std::realloc (ptr, new_size);
+          if (!nptr)
+            throw std::bad_alloc ();
+          return nptr;
+        }
+      
+      if (old_size <= SLAB_MAX_CLASS && new_size <= SLAB_MAX_CLASS
+        && _size_class (old_size) == _size_class (new_size))
+        {
+          // same size class, nothing to do.
+          new_size = _class_size (_size_class (old_size));
+          return ptr;
+        }
+      
+      void *nptr = this->alloc (new_size);
+      std::memcpy (nptr, ptr, (used < new_size) ? used : new_size);
+      this->free (ptr, old_size);
+      return nptr;
+    }
+    
+    /* 
+     * Returns completely unused slabs back to the system.
+     */
+    void
+    slab_allocator::release_empty ()
+    {
+      // keep a single empty slab of every size class around to avoid
+      // thrashing when a payload is repeatedly allocated and released.
+      bool kept[SLAB_CLASS_COUNT] = { };
+      
+      unsigned int j = 0;
+      for (unsigned int i = 0; i < this->slabs.size (); ++i)
+        {
+          slab *s = this->slabs[i];
+          if (s->used == 0 && kept[s->cls])
+            {
+              if (s->partial)
+                this->unlink_partial (s);
+              std::free (s);
+            }
+          else
+            {
+              if (s->used == 0)
+                kept[s->cls] = true;
+              this->slabs[j++] = s;
+            }
+        }
+      
+      this->slabs.resize (j);
+    }
+  }
+}
+
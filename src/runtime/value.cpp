@@ -18,11 +18,16 @@
 
 #include "runtime/value.hpp"
 #include "runtime/vm.hpp"
+#include "runtime/output.hpp"
+#include "runtime/numconv.hpp"
+#include "common/utils.hpp"
 #include <stdexcept>
 #include <cstring>
 #include <sstream>
 #include <iomanip>
 #include <cstdlib>
+#include <algorithm>
+#include <vector>
 
 #include <iostream> // DEBUG
 
@@ -67,6 +72,7 @@ namespace arane {
       case PERL_UNDEF:      return "undef";
       case PERL_INT:        return "int";
       case PERL_BOOL:       return "bool";
+      case PERL_ISTR:       return "Str";
       
       case PERL_REF:
         {
@@ -134,7 +140,7 @@ namespace arane {
       case PTYPE_BOOL_NATIVE:
         return val.type == PERL_BOOL;
       case PTYPE_STR:
-        return val.type == PERL_CSTR ||
+        return val.type == PERL_CSTR || val.type == PERL_ISTR ||
           (val.type == PERL_REF && val.val.ref && val.val.ref->type == PERL_DSTR);
       case PTYPE_ARRAY:
         return val.type == PERL_REF && val.val.ref && val.val.ref->type == PERL_ARRAY;
@@ -191,9 +197,10 @@ namespace arane {
           // int -> Int
           case PERL_INT:
             {
-              p_value *data = vm.get_gc ().alloc (true);
+              p_value *data = vm.get_gc ().alloc ();
               data->type = PERL_BIGINT;
-              mpz_init_set_ui (data->val.bint, a.val.i64);
+              vm.get_gc ().init_bint (data->val.bint);
+              mpz_set_si (data->val.bint, a.val.i64);
               
               p_value res;
               res.type = PERL_REF;
@@ -247,6 +254,7 @@ namespace arane {
             break;
           
           case PERL_CSTR:
+          case PERL_ISTR:
             return a;
           
           default:
@@ -261,13 +269,15 @@ namespace arane {
   
   
   
-  /* 
-   * Removes GC protection from the specified value.
-   */
-  void
-  p_value_unprotect (p_value *val)
+  p_value
+  p_value_make_istr (const char *data, unsigned int len)
   {
-    val->gc_protect = false;
+    p_value res;
+    res.type = PERL_ISTR;
+    std::memset (res.val.istr, 0, ISTR_MAX_LEN);
+    std::memcpy (res.val.istr, data, len);
+    res.val.istr[ISTR_MAX_LEN] = ISTR_MAX_LEN - len;
+    return res;
   }
   
   
@@ -285,15 +295,17 @@ namespace arane {
           {
           case PERL_DSTR:
             {
+              p_value_flatten (src, vm);
               auto& src_str = src.val.ref->val.str;
+              if (src_str.len <= ISTR_MAX_LEN)
+                return p_value_make_istr (src_str.data, src_str.len);
               
-              p_value *data = vm.get_gc ().alloc (true);
+              // the characters are copied once either string is modified.
+              p_value *data = vm.get_gc ().alloc ();
               data->type = PERL_DSTR;
-              auto& str = data->val.str;
-              str.cap = src_str.cap;
-              str.len = src_str.len;
-              str.data = new char [str.cap];
-              std::strcpy (str.data, src_str.data);
+              data->val.str = src_str;
+              data->hash = src.val.ref->hash;
+              vm.get_gc ().share_payload (src.val.ref, data);
               
               p_value ret;
               ret.type = PERL_REF;
@@ -303,16 +315,12 @@ namespace arane {
           
           case PERL_ARRAY:
             {
-              auto& src_arr = src.val.ref->val.arr;
-              
-              p_value *data = vm.get_gc ().alloc (true);
+              // the elements are copied once either array is modified.
+              p_value *data = vm.get_gc ().alloc ();
               data->type = PERL_ARRAY;
-              auto& arr = data->val.arr;
-              arr.cap = src_arr.cap;
-              arr.len = src_arr.len;
-              arr.data = new p_value [arr.cap];
-              for (unsigned int i = 0; i < arr.len; ++i)
-                arr.data[i] = src_arr.data[i];
+              data->val.arr = src.val.ref->val.arr;
+              data->off = src.val.ref->off;
+              vm.get_gc ().share_payload (src.val.ref, data);
               
               p_value ret;
               ret.type = PERL_REF;
@@ -323,9 +331,10 @@ namespace arane {
           
           case PERL_BIGINT:
             {
-              p_value *data = vm.get_gc ().alloc (true);
+              p_value *data = vm.get_gc ().alloc ();
               data->type = PERL_BIGINT;
-              mpz_init_set (data->val.bint, src.val.ref->val.bint);
+              vm.get_gc ().init_bint (data->val.bint);
+              mpz_set (data->val.bint, src.val.ref->val.bint);
               
               p_value ret;
               ret.type = PERL_REF;
@@ -359,6 +368,58 @@ namespace arane {
       }
   }
   
+  /* 
+   * Returns the length of a string that is either static, in place, or
+   * referenced.
+   */
+  static unsigned int
+  _rope_part_len (p_value& val)
+  {
+    if (val.type == PERL_CSTR)
+      return val.val.cstr.len;
+    else if (val.type == PERL_ISTR)
+      return p_istr_len (val);
+    else if (val.type == PERL_REF)
+      return val.val.ref->val.str.len;
+    return val.val.str.len;
+  }
+  
+  /* 
+   * Calls "fn" with the data and length of every piece of the specified
+   * string, from left to right.  Regular strings consist of a single piece.
+   */
+  template<typename Fn>
+  static void
+  _walk_str (p_value& str, Fn fn)
+  {
+    // pieces are paired with the number of characters used from them, which
+    // is less than their length for the tails of older ropes.
+    std::vector<std::pair<p_value *, unsigned int>> work;
+    work.push_back ({ &str, _rope_part_len (str) });
+    while (!work.empty ())
+      {
+        p_value *v = work.back ().first;
+        unsigned int len = work.back ().second;
+        work.pop_back ();
+        if (v->type == PERL_REF)
+          v = v->val.ref;
+        
+        if (v->type == PERL_CSTR)
+          fn (v->val.cstr.data, len);
+        else if (v->type == PERL_ISTR)
+          fn (v->val.istr, len);
+        else if (v->flags & PF_ROPE)
+          {
+            p_rope *node = (p_rope *)v->val.str.data;
+            unsigned int left_len = _rope_part_len (node->left);
+            work.push_back ({ &node->right, len - left_len });
+            work.push_back ({ &node->left, left_len });
+          }
+        else
+          fn (v->val.str.data, len);
+      }
+  }
+  
   /* 
    * Returns a textual representation of the specified value.
    */  
@@ -411,21 +472,37 @@ namespace arane {
       case PERL_CSTR:
         return std::string (val.val.cstr.data);
       
+      case PERL_ISTR:
+        return std::string (val.val.istr, p_istr_len (val));
+      
       case PERL_DSTR:
+        if (val.flags & PF_ROPE)
+          {
+            std::string str;
+            str.reserve (val.val.str.len);
+            _walk_str (val, [&str] (const char *data, unsigned int len) {
+                str.append (data, len);
+              });
+            return str;
+          }
         return std::string (val.val.str.data);
       
       case PERL_INT:
         {
-          std::ostringstream ss;
-          ss << val.val.i64;
-          return ss.str ();
+          char buf[INT_STR_SIZE];
+          return std::string (buf, numconv::format_int (val.val.i64, buf));
         }
         
       case PERL_BIGINT:
         {
+          // the string is allocated with GMP's memory functions, and must be
+          // released with them as well.
+          void (*free_func) (void *, size_t);
+          mp_get_memory_functions (nullptr, nullptr, &free_func);
+          
           char *s = mpz_get_str (nullptr, 10, val.val.bint);
           std::string str {s};
-          free (s);
+          free_func (s, str.size () + 1);
           return str;
         }
         
@@ -446,6 +523,80 @@ namespace arane {
       }
   }
   
+  void
+  p_value_write (output_writer& out, p_value& val)
+  {
+    p_value *v = &val;
+    if (v->type == PERL_REF && v->val.ref)
+      switch (v->val.ref->type)
+        {
+        case PERL_DSTR:
+        case PERL_BIGINT:
+          v = v->val.ref;
+          break;
+        
+        default: ;
+        }
+    
+    switch (v->type)
+      {
+      case PERL_ISTR:
+        out.write (v->val.istr, p_istr_len (*v));
+        break;
+      
+      case PERL_CSTR:
+      case PERL_DSTR:
+        // ropes are written piece by piece.
+        _walk_str (*v, [&out] (const char *data, unsigned int len) {
+            out.write (data, len);
+          });
+        break;
+      
+      case PERL_INT:
+        out.write_int (v->val.i64);
+        break;
+      
+      case PERL_BIGINT:
+        out.write_bint (v->val.bint);
+        break;
+      
+      default:
+        {
+          std::string str = p_value_str (val);
+          out.write (str.data (), str.length ());
+        }
+        break;
+      }
+  }
+  
+  
+  
+  void
+  p_value_flatten (p_value& val, virtual_machine& vm)
+  {
+    p_value *obj = (val.type == PERL_REF) ? val.val.ref : &val;
+    if (!obj || obj->type != PERL_DSTR || !(obj->flags & PF_ROPE))
+      return;
+    
+    // the halves stay reachable through the rope until it is replaced.
+    auto& gc = vm.get_gc ();
+    unsigned int cap = obj->val.str.len + 1;
+    char *data = gc.alloc_string_data (cap);
+    char *out = data;
+    _walk_str (*obj, [&out] (const char *part, unsigned int len) {
+        std::memcpy (out, part, len);
+        out += len;
+      });
+    *out = '\0';
+    
+    gc.free_payload (obj->val.str.data, obj->val.str.cap);
+    obj->val.str.data = data;
+    obj->val.str.cap = cap;
+    obj->flags &= ~PF_ROPE;
+  }
+  
+  
+  
   /*
    * Checks whether the contents of the two specified values are references
    * to the same data.
@@ -471,12 +622,112 @@ namespace arane {
   
   
   
+  /* 
+   * Stores the characters of the specified string and their count in "data"
+   * and "len", and the value that holds them in "obj".  Returns false if
+   * the value is not a string, or is a rope.
+   */
+  static bool
+  _str_data (p_value& val, p_value *& obj, const char *& data,
+    unsigned int& len)
+  {
+    p_value *v = obj = &val;
+    if (v->type == PERL_REF && v->val.ref)
+      v = obj = v->val.ref;
+    
+    switch (v->type)
+      {
+      case PERL_CSTR:
+        data = v->val.cstr.data;
+        len = v->val.cstr.len;
+        return true;
+      
+      case PERL_ISTR:
+        data = v->val.istr;
+        len = p_istr_len (*v);
+        return true;
+      
+      case PERL_DSTR:
+        if (v->flags & PF_ROPE)
+          return false;
+        data = v->val.str.data;
+        len = v->val.str.len;
+        return true;
+      
+      default:
+        return false;
+      }
+  }
+  
+  unsigned int
+  p_value_hash (p_value& val)
+  {
+    p_value *obj = &val;
+    if (obj->type == PERL_REF && obj->val.ref)
+      obj = obj->val.ref;
+    
+    switch (obj->type)
+      {
+      case PERL_ISTR:
+        return utils::str_hash (obj->val.istr, p_istr_len (*obj));
+      
+      case PERL_CSTR:
+      case PERL_DSTR:
+        if (!obj->hash)
+          {
+            p_value *str;
+            const char *data;
+            unsigned int len;
+            if (_str_data (*obj, str, data, len))
+              obj->hash = utils::str_hash (data, len);
+            else
+              {
+                // ropes are hashed in one piece.
+                std::string tmp = p_value_str (*obj);
+                obj->hash = utils::str_hash (tmp.data (), tmp.length ());
+              }
+          }
+        return obj->hash;
+      
+      default:
+        {
+          std::string tmp = p_value_str (val);
+          return utils::str_hash (tmp.data (), tmp.length ());
+        }
+      }
+  }
+  
+  
+  
   /* 
    * Checks for equality between the two specified values.
    */
   bool
   p_value_eq (p_value& a, p_value& b)
   {
+    // literals are interned by the linker, and short strings are padded
+    // with zeroes.
+    if (a.type == PERL_CSTR && b.type == PERL_CSTR)
+      return a.val.cstr.data == b.val.cstr.data;
+    if (a.type == PERL_ISTR && b.type == PERL_ISTR)
+      return std::memcmp (a.val.istr, b.val.istr, ISTR_MAX_LEN + 1) == 0;
+    
+    // other strings are compared by contents, unless both hashes are known
+    // and tell them apart.  The cost of hashing a string here would match
+    // that of the comparison itself, so unknown hashes are left alone.
+    p_value *aobj, *bobj;
+    const char *adata, *bdata;
+    unsigned int alen, blen;
+    if (_str_data (a, aobj, adata, alen) && _str_data (b, bobj, bdata, blen))
+      {
+        if (alen != blen)
+          return false;
+        if (aobj->type != PERL_ISTR && bobj->type != PERL_ISTR
+          && aobj->hash && bobj->hash && aobj->hash != bobj->hash)
+          return false;
+        return std::memcmp (adata, bdata, alen) == 0;
+      }
+    
     switch (a.type)
       {
       case PERL_BOOL:
@@ -889,9 +1140,10 @@ namespace arane {
               // int + Int
               case PERL_BIGINT:
                 {
-                  p_value *data = vm.get_gc ().alloc (true);
+                  p_value *data = vm.get_gc ().alloc ();
                   data->type = PERL_BIGINT;
-                  mpz_init_set_ui (data->val.bint, a.val.i64);
+                  vm.get_gc ().init_bint (data->val.bint);
+                  mpz_set_si (data->val.bint, a.val.i64);
                   mpz_add (data->val.bint, data->val.bint, b.val.ref->val.bint);
                   
                   res.type = PERL_REF;
@@ -920,10 +1172,10 @@ namespace arane {
               // Int + int
               case PERL_INT:
                 {
-                  p_value *data = vm.get_gc ().alloc (true);
+                  p_value *data = vm.get_gc ().alloc ();
                   data->type = PERL_BIGINT;
-                  mpz_init_set (data->val.bint, a.val.ref->val.bint);
-                  mpz_add_ui (data->val.bint, data->val.bint, b.val.i64);
+                  vm.get_gc ().init_bint (data->val.bint);
+                  mpz_add_ui (data->val.bint, a.val.ref->val.bint, b.val.i64);
                   
                   res.type = PERL_REF;
                   res.val.ref = data;
@@ -936,10 +1188,10 @@ namespace arane {
                   // Int + Int
                   case PERL_BIGINT:
                     {
-                      p_value *data = vm.get_gc ().alloc (true);
+                      p_value *data = vm.get_gc ().alloc ();
                       data->type = PERL_BIGINT;
-                      mpz_init_set (data->val.bint, a.val.ref->val.bint);
-                      mpz_add (data->val.bint, data->val.bint, b.val.ref->val.bint);
+                      vm.get_gc ().init_bint (data->val.bint);
+                      mpz_add (data->val.bint, a.val.ref->val.bint, b.val.ref->val.bint);
                       
                       res.type = PERL_REF;
                       res.val.ref = data;
@@ -994,9 +1246,10 @@ namespace arane {
               // int + Int
               case PERL_BIGINT:
                 {
-                  p_value *data = vm.get_gc ().alloc (true);
+                  p_value *data = vm.get_gc ().alloc ();
                   data->type = PERL_BIGINT;
-                  mpz_init_set_ui (data->val.bint, a.val.i64);
+                  vm.get_gc ().init_bint (data->val.bint);
+                  mpz_set_si (data->val.bint, a.val.i64);
                   mpz_sub (data->val.bint, data->val.bint, b.val.ref->val.bint);
                   
                   res.type = PERL_REF;
@@ -1025,10 +1278,10 @@ namespace arane {
               // Int + int
               case PERL_INT:
                 {
-                  p_value *data = vm.get_gc ().alloc (true);
+                  p_value *data = vm.get_gc ().alloc ();
                   data->type = PERL_BIGINT;
-                  mpz_init_set (data->val.bint, a.val.ref->val.bint);
-                  mpz_sub_ui (data->val.bint, data->val.bint, b.val.i64);
+                  vm.get_gc ().init_bint (data->val.bint);
+                  mpz_sub_ui (data->val.bint, a.val.ref->val.bint, b.val.i64);
                   
                   res.type = PERL_REF;
                   res.val.ref = data;
@@ -1041,10 +1294,10 @@ namespace arane {
                   // Int + Int
                   case PERL_BIGINT:
                     {
-                      p_value *data = vm.get_gc ().alloc (true);
+                      p_value *data = vm.get_gc ().alloc ();
                       data->type = PERL_BIGINT;
-                      mpz_init_set (data->val.bint, a.val.ref->val.bint);
-                      mpz_sub (data->val.bint, data->val.bint, b.val.ref->val.bint);
+                      vm.get_gc ().init_bint (data->val.bint);
+                      mpz_sub (data->val.bint, a.val.ref->val.bint, b.val.ref->val.bint);
                       
                       res.type = PERL_REF;
                       res.val.ref = data;
@@ -1099,9 +1352,10 @@ namespace arane {
               // int + Int
               case PERL_BIGINT:
                 {
-                  p_value *data = vm.get_gc ().alloc (true);
+                  p_value *data = vm.get_gc ().alloc ();
                   data->type = PERL_BIGINT;
-                  mpz_init_set_ui (data->val.bint, a.val.i64);
+                  vm.get_gc ().init_bint (data->val.bint);
+                  mpz_set_si (data->val.bint, a.val.i64);
                   mpz_mul (data->val.bint, data->val.bint, b.val.ref->val.bint);
                   
                   res.type = PERL_REF;
@@ -1130,10 +1384,10 @@ namespace arane {
               // Int + int
               case PERL_INT:
                 {
-                  p_value *data = vm.get_gc ().alloc (true);
+                  p_value *data = vm.get_gc ().alloc ();
                   data->type = PERL_BIGINT;
-                  mpz_init_set (data->val.bint, a.val.ref->val.bint);
-                  mpz_mul_ui (data->val.bint, data->val.bint, b.val.i64);
+                  vm.get_gc ().init_bint (data->val.bint);
+                  mpz_mul_ui (data->val.bint, a.val.ref->val.bint, b.val.i64);
                   
                   res.type = PERL_REF;
                   res.val.ref = data;
@@ -1146,10 +1400,10 @@ namespace arane {
                   // Int + Int
                   case PERL_BIGINT:
                     {
-                      p_value *data = vm.get_gc ().alloc (true);
+                      p_value *data = vm.get_gc ().alloc ();
                       data->type = PERL_BIGINT;
-                      mpz_init_set (data->val.bint, a.val.ref->val.bint);
-                      mpz_mul (data->val.bint, data->val.bint, b.val.ref->val.bint);
+                      vm.get_gc ().init_bint (data->val.bint);
+                      mpz_mul (data->val.bint, a.val.ref->val.bint, b.val.ref->val.bint);
                       
                       res.type = PERL_REF;
                       res.val.ref = data;
@@ -1208,9 +1462,10 @@ namespace arane {
                 {
                   if (mpz_sgn (b.val.ref->val.bint) == 0)
                     throw vm_error ("division by zero");
-                  p_value *data = vm.get_gc ().alloc (true);
+                  p_value *data = vm.get_gc ().alloc ();
                   data->type = PERL_BIGINT;
-                  mpz_init_set_ui (data->val.bint, a.val.i64);
+                  vm.get_gc ().init_bint (data->val.bint);
+                  mpz_set_si (data->val.bint, a.val.i64);
                   mpz_div (data->val.bint, data->val.bint, b.val.ref->val.bint);
                   
                   res.type = PERL_REF;
@@ -1241,10 +1496,10 @@ namespace arane {
                 {
                   if (b.val.i64 == 0)
                     throw vm_error ("division by zero");
-                  p_value *data = vm.get_gc ().alloc (true);
+                  p_value *data = vm.get_gc ().alloc ();
                   data->type = PERL_BIGINT;
-                  mpz_init_set (data->val.bint, a.val.ref->val.bint);
-                  mpz_div_ui (data->val.bint, data->val.bint, b.val.i64);
+                  vm.get_gc ().init_bint (data->val.bint);
+                  mpz_div_ui (data->val.bint, a.val.ref->val.bint, b.val.i64);
                   
                   res.type = PERL_REF;
                   res.val.ref = data;
@@ -1259,10 +1514,10 @@ namespace arane {
                     {
                       if (mpz_sgn (b.val.ref->val.bint) == 0)
                         throw vm_error ("division by zero");
-                      p_value *data = vm.get_gc ().alloc (true);
+                      p_value *data = vm.get_gc ().alloc ();
                       data->type = PERL_BIGINT;
-                      mpz_init_set (data->val.bint, a.val.ref->val.bint);
-                      mpz_div (data->val.bint, data->val.bint, b.val.ref->val.bint);
+                      vm.get_gc ().init_bint (data->val.bint);
+                      mpz_div (data->val.bint, a.val.ref->val.bint, b.val.ref->val.bint);
                       
                       res.type = PERL_REF;
                       res.val.ref = data;
@@ -1321,9 +1576,10 @@ namespace arane {
                 {
                   if (mpz_sgn (b.val.ref->val.bint) == 0)
                     throw vm_error ("division by zero");
-                  p_value *data = vm.get_gc ().alloc (true);
+                  p_value *data = vm.get_gc ().alloc ();
                   data->type = PERL_BIGINT;
-                  mpz_init_set_ui (data->val.bint, a.val.i64);
+                  vm.get_gc ().init_bint (data->val.bint);
+                  mpz_set_si (data->val.bint, a.val.i64);
                   mpz_mod (data->val.bint, data->val.bint, b.val.ref->val.bint);
                   
                   res.type = PERL_REF;
@@ -1354,10 +1610,10 @@ namespace arane {
                 {
                   if (b.val.i64 == 0)
                     throw vm_error ("division by zero");
-                  p_value *data = vm.get_gc ().alloc (true);
+                  p_value *data = vm.get_gc ().alloc ();
                   data->type = PERL_BIGINT;
-                  mpz_init_set (data->val.bint, a.val.ref->val.bint);
-                  mpz_mod_ui (data->val.bint, data->val.bint, b.val.i64);
+                  vm.get_gc ().init_bint (data->val.bint);
+                  mpz_mod_ui (data->val.bint, a.val.ref->val.bint, b.val.i64);
                   
                   res.type = PERL_REF;
                   res.val.ref = data;
@@ -1372,10 +1628,10 @@ namespace arane {
                     {
                       if (mpz_sgn (b.val.ref->val.bint) == 0)
                         throw vm_error ("division by zero");
-                      p_value *data = vm.get_gc ().alloc (true);
+                      p_value *data = vm.get_gc ().alloc ();
                       data->type = PERL_BIGINT;
-                      mpz_init_set (data->val.bint, a.val.ref->val.bint);
-                      mpz_mod (data->val.bint, data->val.bint, b.val.ref->val.bint);
+                      vm.get_gc ().init_bint (data->val.bint);
+                      mpz_mod (data->val.bint, a.val.ref->val.bint, b.val.ref->val.bint);
                       
                       res.type = PERL_REF;
                       res.val.ref = data;
@@ -1413,16 +1669,36 @@ namespace arane {
   p_value
   p_value_to_str (p_value& val, virtual_machine& vm)
   {
-    std::string str = p_value_str (val);
+    if (val.type == PERL_ISTR)
+      return val;
+    
+    std::string tmp;
+    const char *str;
+    unsigned int len;
+    char buf[INT_STR_SIZE];
+    if (val.type == PERL_INT)
+      {
+        len = numconv::format_int (val.val.i64, buf);
+        str = buf;
+      }
+    else
+      {
+        tmp = p_value_str (val);
+        str = tmp.c_str ();
+        len = tmp.length ();
+      }
+    
+    if (len <= ISTR_MAX_LEN)
+      return p_value_make_istr (str, len);
     
-    unsigned int cap = str.length () + 11;
-    p_value *data = vm.get_gc ().alloc (true);
+    unsigned int cap = len + 1;
+    p_value *data = vm.get_gc ().alloc ();
     data->type = PERL_DSTR;
-    data->val.str.data = new char [cap];
-    data->val.str.len = str.length ();
+    data->val.str.data = vm.get_gc ().alloc_string_data (cap);
+    data->val.str.len = len;
     data->val.str.cap = cap;
-    std::strcpy (data->val.str.data, str.c_str ());
-    vm.get_gc ().notify_increase (cap);
+    std::memcpy (data->val.str.data, str, len);
+    data->val.str.data[len] = '\0';
     
     p_value res;
     res.type = PERL_REF;
@@ -1445,18 +1721,30 @@ namespace arane {
       
       case PERL_CSTR:
         {
-          std::istringstream ss { val.val.cstr.data };
           long long n;
-          ss >> n;
+          numconv::parse_int (val.val.cstr.data, val.val.cstr.len, n);
+          return n;
+        }
+        break;
+      
+      case PERL_ISTR:
+        {
+          long long n;
+          numconv::parse_int (val.val.istr, p_istr_len (val), n);
           return n;
         }
         break;
       
       case PERL_DSTR:
         {
-          std::istringstream ss { val.val.str.data };
           long long n;
-          ss >> n;
+          if (val.flags & PF_ROPE)
+            {
+              std::string str = p_value_str (val);
+              numconv::parse_int (str.data (), str.length (), n);
+            }
+          else
+            numconv::parse_int (val.val.str.data, val.val.str.len, n);
           return n;
         }
         break;
@@ -1481,6 +1769,20 @@ namespace arane {
   
   
   
+  /* 
+   * Parses a string into a big integer, through a native integer if the
+   * number is small enough.
+   */
+  static void
+  _parse_bint (const char *str, unsigned int len, mpz_ptr res)
+  {
+    long long n;
+    if (numconv::parse_int (str, len, n) == numconv::PARSE_OVERFLOW)
+      numconv::parse_bint (str, len, res);
+    else
+      mpz_set_si (res, n);
+  }
+  
   p_value
   p_value_to_big_int (p_value& val, virtual_machine& vm)
   {
@@ -1488,9 +1790,24 @@ namespace arane {
     switch (val.type)
       {
       case PERL_INT:
-        data = vm.get_gc ().alloc (true);
+        data = vm.get_gc ().alloc ();
         data->type = PERL_BIGINT;
-        mpz_init_set_ui (data->val.bint, val.val.i64);
+        vm.get_gc ().init_bint (data->val.bint);
+        mpz_set_si (data->val.bint, val.val.i64);
+        break;
+      
+      case PERL_CSTR:
+        data = vm.get_gc ().alloc ();
+        data->type = PERL_BIGINT;
+        vm.get_gc ().init_bint (data->val.bint);
+        _parse_bint (val.val.cstr.data, val.val.cstr.len, data->val.bint);
+        break;
+      
+      case PERL_ISTR:
+        data = vm.get_gc ().alloc ();
+        data->type = PERL_BIGINT;
+        vm.get_gc ().init_bint (data->val.bint);
+        _parse_bint (val.val.istr, p_istr_len (val), data->val.bint);
         break;
       
       case PERL_REF:
@@ -1499,18 +1816,29 @@ namespace arane {
           case PERL_BIGINT:
             return val;
           
+          case PERL_DSTR:
+            {
+              p_value_flatten (val, vm);
+              auto& str = val.val.ref->val.str;
+              data = vm.get_gc ().alloc ();
+              data->type = PERL_BIGINT;
+              vm.get_gc ().init_bint (data->val.bint);
+              _parse_bint (str.data, str.len, data->val.bint);
+            }
+            break;
+          
           default:
-            data = vm.get_gc ().alloc (true);
+            data = vm.get_gc ().alloc ();
             data->type = PERL_BIGINT;
-            mpz_init (data->val.bint);
+            vm.get_gc ().init_bint (data->val.bint);
             break;
           }
         break;
       
       default:
-        data = vm.get_gc ().alloc (true);
+        data = vm.get_gc ().alloc ();
         data->type = PERL_BIGINT;
-        mpz_init (data->val.bint);
+        vm.get_gc ().init_bint (data->val.bint);
         break;
       }
     
@@ -1539,6 +1867,10 @@ namespace arane {
         res.val.bl = val.val.bl;
         break;
       
+      case PERL_ISTR:
+        res.val.bl = (p_istr_len (val) != 0);
+        break;
+      
       case PERL_REF:
         switch (val.val.ref->type)
           {
@@ -1574,26 +1906,448 @@ namespace arane {
   
   
   
-  p_value
-  p_value_concat (p_value& a, p_value& b, virtual_machine& vm)
+  /* 
+   * Stores a pointer to the characters of the specified value and their
+   * number in "data" and "len", if it is a string that holds them in one
+   * piece.  Returns false otherwise.
+   */
+  static bool
+  _str_data (p_value& val, const char *& data, unsigned int& len)
   {
-    std::string str;
-    str.append (p_value_str (a));
-    str.append (p_value_str (b));
+    p_value *v = &val;
+    if (v->type == PERL_REF && v->val.ref && v->val.ref->type == PERL_DSTR)
+      v = v->val.ref;
     
-    unsigned int cap = str.length () + 11;
-    p_value *data = vm.get_gc ().alloc (true);
+    switch (v->type)
+      {
+      case PERL_CSTR:
+        data = v->val.cstr.data;
+        len = v->val.cstr.len;
+        return true;
+      
+      case PERL_ISTR:
+        data = v->val.istr;
+        len = p_istr_len (*v);
+        return true;
+      
+      case PERL_DSTR:
+        if (v->flags & PF_ROPE)
+          return false;
+        data = v->val.str.data;
+        len = v->val.str.len;
+        return true;
+      
+      default:
+        return false;
+      }
+  }
+  
+  /* 
+   * Returns the textual representation of a value that _str_data () can not
+   * view in place.
+   */
+  static std::string
+  _str_text (p_value& val)
+  {
+    if (val.type == PERL_REF && val.val.ref && val.val.ref->type == PERL_DSTR)
+      return p_value_str (*val.val.ref);
+    return p_value_str (val);
+  }
+  
+  /* 
+   * Stores a pointer to the textual representation of the specified value
+   * and its length in "data" and "len".  Strings are referenced directly;
+   * everything else is converted into "tmp".
+   */
+  static void
+  _str_view (p_value& val, std::string& tmp, const char *& data,
+    unsigned int& len)
+  {
+    if (_str_data (val, data, len))
+      return;
+    
+    tmp = _str_text (val);
+    data = tmp.c_str ();
+    len = tmp.length ();
+  }
+  
+  /* 
+   * Concatenates values into a single new regular string.
+   */
+  static p_value
+  _concat_flat (p_value *vals, unsigned int count, virtual_machine& vm)
+  {
+    // the views of up to 16 parts are kept on the stack, more than that
+    // fall back to vectors.
+    const unsigned int inline_parts = 16;
+    
+    const char *data_inline[inline_parts];
+    unsigned int len_inline[inline_parts];
+    
+    std::vector<const char *> data_heap;
+    std::vector<unsigned int> len_heap;
+    
+    const char **datas = data_inline;
+    unsigned int *lens = len_inline;
+    if (count > inline_parts)
+      {
+        data_heap.resize (count);
+        len_heap.resize (count);
+        datas = data_heap.data ();
+        lens = len_heap.data ();
+      }
+    
+    // only parts that are not strings already are converted.  room for all
+    // of them is reserved up front, so that adding one never moves the
+    // characters of the others.
+    std::vector<std::string> tmps;
+    
+    // size the result once
+    unsigned int total = 0;
+    for (unsigned int i = 0; i < count; ++i)
+      {
+        if (!_str_data (vals[i], datas[i], lens[i]))
+          {
+            if (tmps.empty ())
+              tmps.reserve (count - i);
+            tmps.push_back (_str_text (vals[i]));
+            datas[i] = tmps.back ().c_str ();
+            lens[i] = tmps.back ().length ();
+          }
+        total += lens[i];
+      }
+    
+    if (total <= ISTR_MAX_LEN)
+      {
+        p_value res;
+        res.type = PERL_ISTR;
+        std::memset (res.val.istr, 0, ISTR_MAX_LEN);
+        char *out = res.val.istr;
+        for (unsigned int i = 0; i < count; ++i)
+          {
+            std::memcpy (out, datas[i], lens[i]);
+            out += lens[i];
+          }
+        res.val.istr[ISTR_MAX_LEN] = ISTR_MAX_LEN - total;
+        return res;
+      }
+    
+    // the parts are still reachable from the caller, so their buffers
+    // survive the allocation below.
+    unsigned int cap = total + 1;
+    p_value *data = vm.get_gc ().alloc ();
     data->type = PERL_DSTR;
-    data->val.str.data = new char [cap];
-    data->val.str.len = str.length ();
+    data->val.str.data = vm.get_gc ().alloc_string_data (cap);
+    data->val.str.len = total;
     data->val.str.cap = cap;
-    std::strcpy (data->val.str.data, str.c_str ());
-    vm.get_gc ().notify_increase (cap);
+    
+    char *out = data->val.str.data;
+    for (unsigned int i = 0; i < count; ++i)
+      {
+        std::memcpy (out, datas[i], lens[i]);
+        out += lens[i];
+      }
+    *out = '\0';
     
     p_value res;
     res.type = PERL_REF;
     res.val.ref = data;
     return res;
   }
-} 
-
+  
+  /* 
+   * Checks whether the specified value is a string long enough to be linked
+   * into a rope as is.
+   */
+  static bool
+  _is_rope_part (p_value& val)
+  {
+    if (val.type == PERL_CSTR)
+      return val.val.cstr.len >= ROPE_MIN_LEN;
+    
+    return val.type == PERL_REF && val.val.ref
+      && val.val.ref->type == PERL_DSTR
+      && val.val.ref->val.str.len >= ROPE_MIN_LEN;
+  }
+  
+  /* 
+   * Returns the depth of the specified rope part (zero for regular strings).
+   */
+  static unsigned int
+  _rope_depth (p_value& val)
+  {
+    if (val.type == PERL_REF && (val.val.ref->flags & PF_ROPE))
+      return ((p_rope *)val.val.ref->val.str.data)->depth;
+    return 0;
+  }
+  
+  /* 
+   * Allocates a rope string of the specified halves and returns a reference
+   * to it.  The rope is flattened right away if it would nest too deeply.
+   */
+  static p_value
+  _rope_node (p_value& left, p_value& right, unsigned int len,
+    gc::root_scope& roots, virtual_machine& vm)
+  {
+    auto& gc = vm.get_gc ();
+    unsigned int depth = 1 + std::max (_rope_depth (left),
+      _rope_depth (right));
+    
+    // the node is filled in before the string is allocated, so that the
+    // collector never sees a rope without halves.
+    unsigned int size = sizeof (p_rope);
+    p_rope *node = (p_rope *)gc.alloc_payload (size);
+    node->left = left;
+    node->right = right;
+    node->depth = depth;
+    
+    p_value *data = roots.add (gc.alloc ());
+    data->type = PERL_DSTR;
+    data->flags = PF_ROPE;
+    data->val.str.data = (char *)node;
+    data->val.str.len = len;
+    data->val.str.cap = size;
+    
+    p_value res;
+    res.type = PERL_REF;
+    res.val.ref = data;
+    if (depth > ROPE_MAX_DEPTH)
+      p_value_flatten (res, vm);
+    return res;
+  }
+  
+  /* 
+   * Creates a tail string for a rope out of the specified short values,
+   * with room for more characters.
+   */
+  static p_value
+  _rope_tail (p_value *vals, unsigned int count, gc::root_scope& roots,
+    virtual_machine& vm)
+  {
+    std::vector<const char *> datas (count);
+    std::vector<unsigned int> lens (count);
+    std::vector<std::string> tmps;
+    unsigned int total = 0;
+    for (unsigned int i = 0; i < count; ++i)
+      {
+        if (!_str_data (vals[i], datas[i], lens[i]))
+          {
+            // see _concat_flat ()
+            if (tmps.empty ())
+              tmps.reserve (count - i);
+            tmps.push_back (_str_text (vals[i]));
+            datas[i] = tmps.back ().c_str ();
+            lens[i] = tmps.back ().length ();
+          }
+        total += lens[i];
+      }
+    
+    auto& gc = vm.get_gc ();
+    unsigned int cap = std::max (total * 2, 32U);
+    p_value *data = roots.add (gc.alloc ());
+    data->type = PERL_DSTR;
+    data->flags = PF_TAIL;
+    data->val.str.data = gc.alloc_string_data (cap);
+    data->val.str.len = total;
+    data->val.str.cap = cap;
+    
+    char *out = data->val.str.data;
+    for (unsigned int i = 0; i < count; ++i)
+      {
+        std::memcpy (out, datas[i], lens[i]);
+        out += lens[i];
+      }
+    *out = '\0';
+    
+    p_value res;
+    res.type = PERL_REF;
+    res.val.ref = data;
+    return res;
+  }
+  
+  /* 
+   * Appends the specified short values to "rope" by copying them into its
+   * tail, if it has one whose last characters it uses.  Returns false
+   * otherwise.
+   */
+  static bool
+  _rope_append (p_value& rope, p_value *vals, unsigned int count,
+    gc::root_scope& roots, virtual_machine& vm)
+  {
+    if (rope.type != PERL_REF || !(rope.val.ref->flags & PF_ROPE))
+      return false;
+    p_rope *node = (p_rope *)rope.val.ref->val.str.data;
+    if (node->right.type != PERL_REF
+      || !(node->right.val.ref->flags & PF_TAIL))
+      return false;
+    
+    // another rope may have appended to the tail past this one already.
+    auto& tail = node->right.val.ref->val.str;
+    unsigned int len = rope.val.ref->val.str.len;
+    if (tail.len != len - _rope_part_len (node->left))
+      return false;
+    
+    auto& gc = vm.get_gc ();
+    for (unsigned int i = 0; i < count; ++i)
+      {
+        std::string tmp;
+        const char *src;
+        unsigned int src_len;
+        _str_view (vals[i], tmp, src, src_len);
+        if (tail.len + src_len + 1 > tail.cap)
+          {
+            unsigned int cap = std::max (tail.cap * 2, tail.len + src_len + 1);
+            tail.data = gc.resize_string_data (tail.data, tail.len + 1,
+              tail.cap, cap);
+            tail.cap = cap;
+          }
+        
+        std::memcpy (tail.data + tail.len, src, src_len);
+        tail.len += src_len;
+        tail.data[tail.len] = '\0';
+      }
+    
+    // the new rope shares both halves, the old one keeps using the first
+    // characters of the tail.
+    unsigned int add = tail.len - (len - _rope_part_len (node->left));
+    rope = _rope_node (node->left, node->right, len + add, roots, vm);
+    return true;
+  }
+  
+  /* 
+   * Concatenates values, at least one of which is a long string, by linking
+   * them into a rope.
+   */
+  static p_value
+  _concat_rope (p_value *vals, unsigned int count, virtual_machine& vm)
+  {
+    auto& gc = vm.get_gc ();
+    gc::root_scope roots { gc };
+    
+    // long strings are linked as they are, runs of everything else are
+    // appended to the tail of the rope built so far.
+    p_value res;
+    bool empty = true;
+    for (unsigned int i = 0; i < count; )
+      {
+        if (_is_rope_part (vals[i]))
+          {
+            p_value_share (vals[i]);
+            if (empty)
+              res = vals[i];
+            else
+              res = _rope_node (res, vals[i],
+                _rope_part_len (res) + _rope_part_len (vals[i]), roots, vm);
+            empty = false;
+            ++ i;
+            continue;
+          }
+        
+        unsigned int j = i + 1;
+        while (j < count && !_is_rope_part (vals[j]))
+          ++ j;
+        
+        if (empty)
+          {
+            res = _concat_flat (vals + i, j - i, vm);
+            if (res.type == PERL_REF)
+              roots.add (res.val.ref);
+            empty = false;
+          }
+        else if (!_rope_append (res, vals + i, j - i, roots, vm))
+          {
+            p_value tail = _rope_tail (vals + i, j - i, roots, vm);
+            res = _rope_node (res, tail,
+              _rope_part_len (res) + _rope_part_len (tail), roots, vm);
+          }
+        i = j;
+      }
+    
+    return res;
+  }
+  
+  p_value
+  p_value_concat_n (p_value *vals, unsigned int count, virtual_machine& vm)
+  {
+    for (unsigned int i = 0; i < count; ++i)
+      if (_is_rope_part (vals[i]))
+        return _concat_rope (vals, count, vm);
+    
+    return _concat_flat (vals, count, vm);
+  }
+  
+  void
+  p_value_append (p_value& var, p_value& val, virtual_machine& vm)
+  {
+    std::string tmp;
+    const char *src;
+    unsigned int len;
+    _str_view (val, tmp, src, len);
+    
+    auto& gc = vm.get_gc ();
+    if (var.type == PERL_REF && var.val.ref
+      && var.val.ref->type == PERL_DSTR && (var.val.ref->flags & PF_UNIQUE))
+      {
+        // nobody else holds the string, extend it in place.  the appended
+        // value may be the string itself though ($s ~= $s), whose characters
+        // move if the buffer grows.
+        auto& str = var.val.ref->val.str;
+        bool self = val.type == PERL_REF && val.val.ref == var.val.ref;
+        unsigned int need = str.len + len + 1;
+        if (need > str.cap)
+          {
+            unsigned int cap = std::max (str.cap * 2, need);
+            str.data = gc.resize_string_data (str.data, str.len + 1, str.cap,
+              cap);
+            str.cap = cap;
+          }
+        if (self)
+          src = str.data;
+        
+        std::memcpy (str.data + str.len, src, len);
+        str.len += len;
+        str.data[str.len] = '\0';
+        var.val.ref->hash = 0;
+        return;
+      }
+    
+    // copy into a new string with room to grow, which the variable then
+    // owns exclusively.
+    std::string prev_tmp;
+    const char *prev;
+    unsigned int prev_len;
+    _str_view (var, prev_tmp, prev, prev_len);
+    
+    unsigned int total = prev_len + len;
+    if (total <= ISTR_MAX_LEN)
+      {
+        // "prev" may point into the variable, so build the string aside.
+        char buf[ISTR_MAX_LEN];
+        std::memcpy (buf, prev, prev_len);
+        std::memcpy (buf + prev_len, src, len);
+        var = p_value_make_istr (buf, total);
+        return;
+      }
+    
+    unsigned int cap = std::max ((total + 1) * 2, 16U);
+    p_value *data = gc.alloc ();
+    data->type = PERL_DSTR;
+    data->flags = PF_UNIQUE;
+    data->val.str.data = gc.alloc_string_data (cap);
+    data->val.str.len = total;
+    data->val.str.cap = cap;
+    std::memcpy (data->val.str.data, prev, prev_len);
+    std::memcpy (data->val.str.data + prev_len, src, len);
+    data->val.str.data[total] = '\0';
+    
+    var.type = PERL_REF;
+    var.val.ref = data;
+  }
+  
+  p_value
+  p_value_concat (p_value& a, p_value& b, virtual_machine& vm)
+  {
+    p_value parts[2] = { a, b };
+    return p_value_concat_n (parts, 2, vm);
+  }
+}
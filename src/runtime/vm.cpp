@@ -18,10 +18,12 @@
 
 #include "runtime/vm.hpp"
 #include "runtime/gc.hpp"
+#include "runtime/array.hpp"
 #include "runtime/builtins.hpp"
 #include <stdexcept>
 #include <iostream>
 #include <cstring>
+#include <algorithm>
 
 #include <iomanip> // DEBUG
 
@@ -32,14 +34,14 @@
 
 namespace arane {
   
-#define STACK_SIZE        4096
-  
-  virtual_machine::virtual_machine ()
-    : out (&std::cout), in (&std::cin), gc (*this)
+  virtual_machine::virtual_machine (const gc::gc_options& gc_opts)
+    : out (&std::cout), in (&std::cin), gc (*this, gc_opts)
   {
     this->stack = new p_value [STACK_SIZE];
     this->sp = 0;
     this->bp = 0;
+    this->code = nullptr;
+    this->pc = nullptr;
   }
   
   virtual_machine::~virtual_machine ()
@@ -58,21 +60,11 @@ namespace arane {
   void
   virtual_machine::set_out (std::ostream *strm)
   {
-    this->out = strm;
+    this->out.set_stream (strm);
   }
   
   
   
-  static inline void
-  _unprotect_external (p_value& val)
-  {
-    if (val.type == PERL_REF)
-      {
-        if (val.val.ref)
-          p_value_unprotect (val.val.ref);
-      }
-  }
-  
   static void
   _flatten (p_value *stack, int& sp)
   {
@@ -92,6 +84,69 @@ namespace arane {
       }
   }
   
+  /* 
+   * Returns the stack map of the innermost subroutine that contains the
+   * specified code position, or null if there is none.
+   */
+  static const stack_map*
+  _find_stack_map (const std::vector<stack_map>& smaps, unsigned int pos)
+  {
+    // subroutines nest, so the innermost one is the one with the latest
+    // start position that still contains the position.
+    auto itr = std::upper_bound (smaps.begin (), smaps.end (), pos,
+      [] (unsigned int pos, const stack_map& smap) {
+        return pos < smap.start;
+      });
+    while (itr != smaps.begin ())
+      {
+        -- itr;
+        if (pos < itr->end)
+          return &*itr;
+      }
+    
+    return nullptr;
+  }
+  
+  /* 
+   * Flags the stack slots of local variables whose scope has been left
+   * in any of the active frames.
+   */
+  void
+  virtual_machine::find_dead_locals (std::vector<bool>& dead) const
+  {
+    dead.assign (this->sp, false);
+    if (!this->pc)
+      return;
+    
+    // the saved positions point past the current instruction (or the call
+    // instruction in outer frames), so step back into it.
+    unsigned int pos = (*this->pc - this->code) - 1;
+    int fbp = this->bp;
+    while (fbp > 0)
+      {
+        const stack_map *smap = _find_stack_map (this->smaps, pos);
+        if (smap)
+          for (auto& sc : smap->scopes)
+            {
+              if (pos >= sc.start && pos < sc.end)
+                continue;
+              
+              for (unsigned int i = 0; i < sc.loc_count; ++i)
+                {
+                  unsigned int slot = fbp + 1 + sc.first_loc + i;
+                  if (slot < dead.size ())
+                    dead[slot] = true;
+                }
+            }
+        
+        // return address and base pointer of the calling frame
+        pos = this->stack[fbp - 4].val.i64 - 1;
+        fbp = this->stack[fbp - 2].val.i64;
+      }
+  }
+  
+  
+  
   /* 
    * Executes the specified executable.
    * Throws exceptions of type `vm_error' on failure.
@@ -107,9 +162,42 @@ namespace arane {
     int& sp = this->sp;
     int& bp = this->bp;
     
+    this->smaps = exec.get_stack_maps ();
+    std::sort (this->smaps.begin (), this->smaps.end (),
+      [] (const stack_map& a, const stack_map& b) {
+        return a.start < b.start;
+      });
+    this->code = code;
+    
+    // the collector reads the instruction pointer through "pc" only while
+    // the program is running, so it must not outlive this call, even if the
+    // program stops because of an error.
+    struct clear_guard {
+      const unsigned char **& pc;
+      ~clear_guard () { this->pc = nullptr; }
+    } pc_guard { this->pc };
+    this->pc = &ptr;
+    
+    // everything the program printed is handed over once it stops running,
+    // even if it stopped because of an error.
+    struct flush_guard {
+      output_writer& out;
+      ~flush_guard () { this->out.flush (); }
+    } out_guard { this->out };
+    
 #define CHECK_STACK_SPACE(COUNT)  \
   if (sp + (COUNT) > STACK_SIZE)  \
     throw std::runtime_error ("stack overflow");
+
+// comparisons need the characters of rope strings in one piece.
+#define FLATTEN_TOP2  \
+  for (int i = 2; i > 0; --i)  \
+    {  \
+      p_value& v = stack[sp - i];  \
+      if (v.type == PERL_REF && v.val.ref && v.val.ref->type == PERL_DSTR  \
+        && (v.val.ref->flags & PF_ROPE))  \
+        p_value_flatten (v, *this);  \
+    }
     
     for (;;)
       {
@@ -150,6 +238,7 @@ namespace arane {
               stack[sp].type = PERL_CSTR;
               stack[sp].val.cstr.len = *((unsigned int *)(data + pos));
               stack[sp].val.cstr.data = (const char *)(data + pos + 4);
+              stack[sp].hash = *((unsigned int *)(data + pos - 4));
               ++ sp;
             }
             break;
@@ -203,8 +292,8 @@ namespace arane {
               unsigned int pos = *((unsigned int *)ptr);
               ptr += 4;
               
-              this->globs[(const char *)(data + pos + 4)]
-                = stack[--sp];
+              p_value_share (stack[--sp]);
+              this->globs[(const char *)(data + pos + 4)] = stack[sp];
             }
             break;
           
@@ -226,10 +315,7 @@ namespace arane {
           
           // copy - performs a shallow copy of the top-most item on the stack.
           case 0x0B:
-            CHECK_STACK_SPACE(1)
-            stack[sp] = p_value_copy (stack[sp - 1], *this);
-            ++ sp;
-            _unprotect_external (stack[sp - 1]);
+            stack[sp - 1] = p_value_copy (stack[sp - 1], *this);
             break;
           
 //------------------------------------------------------------------------------
@@ -244,42 +330,47 @@ namespace arane {
           case 0x10: 
             stack[sp - 2] = p_value_add (stack[sp - 2], stack[sp - 1], *this);
             -- sp;
-            _unprotect_external (stack[sp - 1]);
             break;
           
           // sub
           case 0x11:
             stack[sp - 2] = p_value_sub (stack[sp - 2], stack[sp - 1], *this);
             -- sp;
-            _unprotect_external (stack[sp - 1]);
             break;
           
           // mul
           case 0x12:
             stack[sp - 2] = p_value_mul (stack[sp - 2], stack[sp - 1], *this);
             -- sp;
-            _unprotect_external (stack[sp - 1]);
             break;
           
           // div
           case 0x13:
             stack[sp - 2] = p_value_div (stack[sp - 2], stack[sp - 1], *this);
             -- sp;
-            _unprotect_external (stack[sp - 1]);
             break;
           
           // mod
           case 0x14:
             stack[sp - 2] = p_value_mod (stack[sp - 2], stack[sp - 1], *this);
             -- sp;
-            _unprotect_external (stack[sp - 1]);
             break;
           
           // concat - concatenate two values together into a string.
           case 0x15:
             stack[sp - 2] = p_value_concat (stack[sp - 2], stack[sp - 1], *this);
             -- sp;
-            _unprotect_external (stack[sp - 1]);
+            break;
+          
+          // concat_n - concatenate the top-most N values into a single string.
+          case 0x16:
+            {
+              unsigned short count = *((unsigned short *)ptr);
+              ptr += 2;
+              
+              stack[sp - count] = p_value_concat_n (&stack[sp - count], count, *this);
+              sp -= count - 1;
+            }
             break;
           
           // ref
@@ -287,29 +378,33 @@ namespace arane {
             if (stack[sp - 1].type != PERL_REF)
               throw std::runtime_error ("cannot take reference of non-reference data type");
             stack[sp - 1].val.ref = &stack[sp - 1];
-            stack[sp - 1].val.ref->is_gc = false;
             stack[sp - 1].type = PERL_REF;
             break;
           
           // deref
           case 0x19:
-            stack[sp - 1] = *stack[sp - 1].val.ref;
+            // strings stay referenced rather than copied out of their object,
+            // which keeps ropes intact until their characters are needed.
+            if (stack[sp - 1].val.ref->type != PERL_DSTR)
+              stack[sp - 1] = *stack[sp - 1].val.ref;
             break;
           
           // ref_assign
           case 0x1A:
             -- sp;
+            p_value_share (stack[sp]);
+            this->gc.shade (*stack[sp - 1].val.ref);
             *stack[sp - 1].val.ref = stack[sp];
             break;
           
           // box
           case 0x1B:
             {
-              p_value *nv = this->gc.alloc_copy (stack[sp - 1], true);
+              p_value_share (stack[sp - 1]);
+              p_value *nv = this->gc.alloc_copy (stack[sp - 1]);
               
               stack[sp - 1].type = PERL_REF;
               stack[sp - 1].val.ref = nv;
-              p_value_unprotect (nv);
             }
             break;
           
@@ -322,11 +417,20 @@ namespace arane {
           
           // jmp
           case 0x20:
-            ptr += 2 + *((short *)ptr);
+            {
+              short off = *((short *)ptr);
+              ptr += 2 + off;
+              
+              // loops close with a backward jump, which makes it a safe point
+              // to move heap objects at.
+              if (off < 0 && this->gc.compaction_pending ())
+                this->gc.compact ();
+            }
             break;
           
           // je - jump if equal
           case 0x21:
+            FLATTEN_TOP2
             if (p_value_eq (stack[sp - 2], stack[sp - 1]))
               ptr += *((short *)ptr);
             ptr += 2;
@@ -335,6 +439,7 @@ namespace arane {
           
           // jne - jump if not equal
           case 0x22:
+            FLATTEN_TOP2
             if (!p_value_eq (stack[sp - 2], stack[sp - 1]))
               ptr += *((short *)ptr);
             ptr += 2;
@@ -343,6 +448,7 @@ namespace arane {
           
           // jl - jump if less than
           case 0x23:
+            FLATTEN_TOP2
             if (p_value_lt (stack[sp - 2], stack[sp - 1]))
               ptr += *((short *)ptr);
             ptr += 2;
@@ -351,6 +457,7 @@ namespace arane {
           
           // jle - jump if less than or equal to
           case 0x24:
+            FLATTEN_TOP2
             if (p_value_lte (stack[sp - 2], stack[sp - 1]))
               ptr += *((short *)ptr);
             ptr += 2;
@@ -359,6 +466,7 @@ namespace arane {
           
           // jg - jump if greater than
           case 0x25:
+            FLATTEN_TOP2
             if (p_value_gt (stack[sp - 2], stack[sp - 1]))
               ptr += *((short *)ptr);
             ptr += 2;
@@ -367,6 +475,7 @@ namespace arane {
           
           // jge - jump if greater than or equal to
           case 0x26:
+            FLATTEN_TOP2
             if (p_value_gte (stack[sp - 2], stack[sp - 1]))
               ptr += *((short *)ptr);
             ptr += 2;
@@ -401,13 +510,7 @@ namespace arane {
               unsigned int count = *((unsigned int *)ptr);
               ptr += 4;
               
-              unsigned int cap = count ? count : 1;
-              
-              p_value *data = this->gc.alloc (true);
-              data->type = PERL_ARRAY;
-              data->val.arr.len = count;
-              data->val.arr.cap = cap;
-              data->val.arr.data = new p_value [cap];
+              p_value *data = array::create (this->gc, count);
               for (unsigned int i = 0; i < count; ++i)
                 {
                   p_value &ch = data->val.arr.data[i];
@@ -417,9 +520,6 @@ namespace arane {
               p_value& val = stack[sp++];
               val.type = PERL_REF;
               val.val.ref = data;
-              p_value_unprotect (data);
-              
-              this->gc.notify_increase (cap * sizeof (p_value));
             }
             break;
           
@@ -433,35 +533,7 @@ namespace arane {
               
               if (arr.type == PERL_REF && arr.val.ref->type == PERL_ARRAY)
                 {
-                  auto& data = arr.val.ref->val.arr;
-                  
-                  // resize if necessary
-                  if (index >= data.len)
-                    {
-                      // need more space?
-                      if (index >= data.cap)
-                        {
-                          // resize internal buffer
-                          
-                          unsigned int ncap = data.cap * 18 / 10;
-                          if (index >= ncap)
-                            ncap = index + 1;
-                          p_value *narr = new p_value [ncap];
-                          for (unsigned int i = 0; i < data.len; ++i)
-                            narr[i] = data.data[i];
-                          for (unsigned int i = data.len; i <= index; ++i)
-                            narr[i].type = PERL_UNDEF;
-                          
-                          this->gc.notify_increase ((ncap - data.cap) * sizeof (p_value));
-                          data.cap = ncap;
-                          delete[] data.data;
-                          data.data = narr;
-                        }
-                      
-                      data.len = index + 1;
-                    }
-                  
-                  data.data[index] = stack[sp - 1];
+                  array::set (this->gc, arr.val.ref, index, stack[sp - 1]);
                 }
               
               sp -= 3;
@@ -502,15 +574,11 @@ namespace arane {
               unsigned short count = *((unsigned short *)ptr);
               ptr += 2;
               
-              unsigned int cap = count ? count : 1;
-              p_value *data = this->gc.alloc (true);
-              data->type = PERL_ARRAY;
+              p_value *data = array::create (this->gc, count);
               auto& arr = data->val.arr;
-              arr.cap = cap;
-              arr.len = count;
-              arr.data = new p_value[cap];
               for (unsigned int i = 0; i < count; ++i)
                 {
+                  p_value_share (stack[sp - (count - i)]);
                   arr.data[i] = stack[sp - (count - i)];
                 }
               
@@ -518,7 +586,6 @@ namespace arane {
               stack[sp].type = PERL_REF;
               stack[sp].val.ref = data;
               ++ sp;
-              p_value_unprotect (data);
             }
             break;
           
@@ -536,29 +603,25 @@ namespace arane {
 
         // to_str
         case 0x40:
-          if (stack[sp - 1].type == PERL_CSTR ||
+          if (stack[sp - 1].type == PERL_CSTR || stack[sp - 1].type == PERL_ISTR ||
               (stack[sp - 1].type == PERL_REF && stack[sp - 1].val.ref && stack[sp - 1].val.ref->type == PERL_DSTR))
             break;
           stack[sp - 1] = p_value_to_str (stack[sp - 1], *this);
-          _unprotect_external (stack[sp - 1]);
           break;
         
         // to_int
         case 0x41:
           stack[sp - 1] = p_value_to_int (stack[sp - 1], *this);
-          _unprotect_external (stack[sp - 1]);
           break;
         
         // to_bint
         case 0x42:
           stack[sp - 1] = p_value_to_big_int (stack[sp - 1], *this);
-          _unprotect_external (stack[sp - 1]);
           break;
         
         // to_bool
         case 0x43:
           stack[sp - 1] = p_value_to_bool (stack[sp - 1], *this);
-          _unprotect_external (stack[sp - 1]);
           break;
         
 //------------------------------------------------------------------------------
@@ -626,6 +689,7 @@ namespace arane {
               unsigned int index = bp + 1 + *ptr++;
               
               -- sp;
+              p_value_share (stack[sp]);
               stack[index] = stack[sp];
             }
             break;
@@ -645,6 +709,7 @@ namespace arane {
               ptr += 4;
               
               -- sp;
+              p_value_share (stack[sp]);
               stack[index] = stack[sp];
             }
             break;
@@ -653,6 +718,7 @@ namespace arane {
           case 0x66:
             {
               unsigned int index = bp + 1 + *ptr++;
+              p_value_share (stack[sp - 1]);
               stack[index] = stack[sp - 1];
             }
             break;
@@ -663,6 +729,7 @@ namespace arane {
               unsigned int index = bp + 1 + *((unsigned int *)ptr);
               ptr += 4;
               
+              p_value_share (stack[sp - 1]);
               stack[index] = stack[sp - 1];
             }
             break;
@@ -672,7 +739,6 @@ namespace arane {
             CHECK_STACK_SPACE(1)
             stack[sp].type = PERL_REF;
             stack[sp].val.ref = &stack[bp + 1 + *ptr++];
-            stack[sp].val.ref->is_gc = false;
             ++ sp;
             break;
           
@@ -682,7 +748,6 @@ namespace arane {
             {
               stack[sp].type = PERL_REF;
               stack[sp].val.ref = &stack[bp + 1 + *((unsigned int *)ptr)];
-              stack[sp].val.ref->is_gc = false;
               ++ sp;
               ptr += 4;
             }
@@ -720,7 +785,22 @@ namespace arane {
           
           // store_def
           case 0x6D:
-            stack[stack[bp - 1].val.i64 + 1] = stack[--sp];
+            p_value_share (stack[--sp]);
+            stack[stack[bp - 1].val.i64 + 1] = stack[sp];
+            break;
+          
+          // append - appends the top-most value to a local variable's string.
+          case 0x6E:
+            p_value_append (stack[bp + 1 + *ptr++], stack[sp - 1], *this);
+            -- sp;
+            break;
+          
+          // appendl - accepts 4-byte indices.
+          case 0x6F:
+            p_value_append (stack[bp + 1 + *((unsigned int *)ptr)],
+              stack[sp - 1], *this);
+            ptr += 4;
+            -- sp;
             break;
           
 //------------------------------------------------------------------------------
@@ -747,6 +827,7 @@ namespace arane {
                 case 0x201: builtins::push (*this, param_count); break;
                 case 0x202: builtins::pop (*this, param_count); break;
                 case 0x203: builtins::shift (*this, param_count); break;
+                case 0x205: builtins::unshift (*this, param_count); break;
                 case 0x204: builtins::range (*this, param_count); break;
                 }
             }
@@ -760,6 +841,10 @@ namespace arane {
               
               unsigned char paramc = *ptr++;
               
+              // the arguments are bound to the callee's parameters.
+              for (int i = 1; i <= paramc; ++i)
+                p_value_share (stack[sp - i]);
+              
               // push return address
               stack[sp].type = PERL_INTERNAL;
               stack[sp].val.i64 = ptr - code;
@@ -777,6 +862,11 @@ namespace arane {
           // return
           case 0x72:
             {
+              // returning into the exit instruction leaves the program's
+              // frame, so its locals are snapshotted before they are gone.
+              if (code[stack[bp - 4].val.i64] == 0xF0)
+                this->gc.check_snapshot (true);
+              
               ptr = code + stack[bp - 4].val.i64;
               
               unsigned char paramc = stack[bp - 3].val.i64;
@@ -798,7 +888,8 @@ namespace arane {
           
           // arg_store
           case 0x74:
-            stack[bp - 5 - *ptr++] = stack[--sp];
+            p_value_share (stack[--sp]);
+            stack[bp - 5 - *ptr++] = stack[sp];
             break;
             
           // arg_load_ref - load reference to an argument
@@ -806,7 +897,6 @@ namespace arane {
             CHECK_STACK_SPACE(1)
             stack[sp].type = PERL_REF;
             stack[sp].val.ref = &stack[bp - 5 - *ptr++];
-            stack[sp].val.ref->is_gc = false;
             ++ sp;
             break;
          
@@ -818,22 +908,17 @@ namespace arane {
             unsigned short count = *((unsigned short *)ptr);
             ptr += 2;
             
-            unsigned int cap = count ? count : 1;
-            p_value *data = this->gc.alloc (true);
-            data->type = PERL_ARRAY;
+            p_value *data = array::create (this->gc, count);
             auto& arr = data->val.arr;
-            arr.cap = cap;
-            arr.len = count;
-            arr.data = new p_value[cap];
             for (unsigned int i = 0; i < count; ++i)
               {
+                p_value_share (stack[sp - i - 1]);
                 arr.data[i] = stack[sp - i - 1];
               }
             
             stack[sp].type = PERL_REF;
             stack[sp].val.ref = data;
             ++ sp;
-            p_value_unprotect (data);
           }
           break;
                     
@@ -866,7 +951,6 @@ namespace arane {
               auto& val = stack[sp - tc - 1];
               stack[sp - tc - 1] = p_value_to_compatible (val, types, tc, *this);
               sp -= tc;
-              _unprotect_external (stack[sp - 1]);
             }
             break;
           
@@ -889,6 +973,7 @@ namespace arane {
               int n = *((int *)ptr);
               ptr += 4;
               
+              this->out.flush ();
               std::cout << "### CHECKPOINT " << n << " ###" << std::endl;
             }
             break;
@@ -897,7 +982,8 @@ namespace arane {
           }
       }
   
-  done: ;
+  done:
+    return;
   }
 }
 
@@ -0,0 +1,27 @@
+# 
+# Runs a test program and compares its output with the expected one.
+# Expects ARANE (the interpreter), SCRIPT and EXPECTED to be defined.
+# Options for the interpreter, such as GC settings, are read from a .args
+# file next to the program, if there is one.
+# 
+
+STRING(REGEX REPLACE "\\.p6$" ".args" args_file ${SCRIPT})
+SET(args "")
+IF(EXISTS ${args_file})
+  FILE(READ ${args_file} args)
+  STRING(STRIP "${args}" args)
+  SEPARATE_ARGUMENTS(args)
+ENDIF()
+
+EXECUTE_PROCESS(COMMAND ${ARANE} ${args} ${SCRIPT}
+  OUTPUT_VARIABLE output
+  ERROR_VARIABLE output
+  RESULT_VARIABLE result)
+FILE(READ ${EXPECTED} expected)
+
+IF(NOT result EQUAL 0)
+  MESSAGE(FATAL_ERROR "${SCRIPT} exited with ${result}:\n${output}")
+ENDIF()
+IF(NOT output STREQUAL expected)
+  MESSAGE(FATAL_ERROR "${SCRIPT}: unexpected output:\n${output}")
+ENDIF()